@@ -0,0 +1,66 @@
+/*
+ * Measures nobuild's own cost per job, without running any compiler:
+ * sorting the graph, planning the jobs (argv, inputs, successors) and
+ * hashing their command lines, for a split-mode rule of many sources.
+ *
+ *   cc -O2 -I.. -o setup setup.c && ./setup [sources] [runs]
+ */
+#define NOB_IMPL 0
+#include "nobuild.h"
+
+int main(int argc, char** argv)
+{
+    const int nsrcs = (argc > 1) ? atoi(argv[1]) : 20000;
+    const int runs  = (argc > 2) ? atoi(argv[2]) : 20;
+
+    compiler_t* cc;
+    INIT_CC(cc);
+    SET_CC(cc, "cc");
+
+    flag_t* flags = NULL;
+    ADD_FLAG(&flags, FLAG("-Wall"));
+    ADD_FLAG(&flags, FLAG("-Wextra"));
+    ADD_FLAG(&flags, FLAG("-O2"));
+    ADD_FLAG(&flags, FLAG("-Iinclude"));
+
+    char name[64];
+    object_t* deps = NULL;
+    for (int i = 1; i < nsrcs; i++) {
+        snprintf(name, sizeof(name), "src/module%05d/file%05d.c", i / 100, i);
+        ADD_OBJECT(&deps, OBJECT(name));
+    }
+    object_t target = OBJECT("src/main.c");
+
+    build_rule_t* rule;
+    INIT_RULE(rule);
+    MAKE_RULE(rule, cc, flags, &target, deps, "app");
+    SET_MODE(rule, BUILD_MODE_SPLIT);
+
+    long long best = -1;
+    int njobs = 0;
+    for (int r = 0; r < runs; r++) {
+        long long start = __now_us();
+
+        build_rule_t** order = NULL;
+        int nrules = 0, capacity = 0;
+        __job_t* jobs = NULL;
+        if (__graph_sort(rule, &order, &nrules, &capacity) != 0 ||
+            __plan_graph(order, nrules, &jobs, &njobs) != 0) {
+            return 1;
+        }
+        __graph_reset(rule);
+        __jobs_free(jobs, njobs);
+        free(order);
+
+        long long elapsed = __now_us() - start;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("%d jobs: %.3f ms to plan, %.3f us per job (best of %d)\n",
+           njobs, best / 1000.0, (double) best / njobs, runs);
+
+    cleanup(rule);
+    return 0;
+}
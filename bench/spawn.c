@@ -0,0 +1,49 @@
+/*
+ * Measures the latency of __spawn() from a scheduler with a large, touched
+ * heap, as nobuild has when it holds a big graph and build database.
+ *
+ *   cc -O2 -I.. -o spawn spawn.c                  && ./spawn [MiB] [runs]
+ *   cc -O2 -I.. -DNOB_USE_FORK -o spawn spawn.c && ./spawn [MiB] [runs]
+ */
+#define NOB_IMPL 0
+#include "nobuild.h"
+
+int main(int argc, char** argv)
+{
+    const size_t mib = (argc > 1) ? strtoul(argv[1], NULL, 10) : 512;
+    const int runs   = (argc > 2) ? atoi(argv[2]) : 1000;
+
+    char* heap = (char*) malloc(mib << 20);
+    if (!heap) {
+        perror("malloc");
+        return 1;
+    }
+    memset(heap, 1, mib << 20);
+
+    char* args[] = { (char*) "true", NULL };
+    long long spawn_us = 0, total_us = 0;
+
+    for (int r = 0; r < runs; r++) {
+        long long start = __now_us();
+        pid_t pid = __spawn(args, -1);
+        long long spawned = __now_us();
+
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+            return 1;
+        }
+        spawn_us += spawned - start;
+        total_us += __now_us() - start;
+    }
+
+#ifdef NOB_USE_FORK
+    const char* how = "fork";
+#else
+    const char* how = "posix_spawnp";
+#endif
+    printf("%s, %zu MiB heap: %.1f us to spawn, %.1f us to spawn and reap\n",
+           how, mib, (double) spawn_us / runs, (double) total_us / runs);
+
+    free(heap);
+    return 0;
+}
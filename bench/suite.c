@@ -0,0 +1,662 @@
+/*
+ * Measures nobuild's own overhead on generated projects, and compares it
+ * with ninja running the same graph when ninja is in PATH.
+ *
+ * Every project has trivial translation units including a few of a shared
+ * pool of headers, popular headers being included far more often than the
+ * others. A "wide" project links all of them into one executable; a
+ * "deep" one spreads them over a chain of static libraries, each linking
+ * the previous one. Jobs run a stub compiler (this program, through a
+ * './cc' symlink) that only writes the object and the depfile a compiler
+ * would, so that what is timed is the build system, not the compiler.
+ * Each project is measured in a forked process, for:
+ *
+ *   graph   declaring the rules, and sorting them (best of --runs)
+ *   plan    building every job's argv, inputs and successors (best)
+ *   spawn   __spawn() and reaping `true`, one process at a time
+ *   build   a full build, and a no-op rebuild of it (best)
+ *   cache   a full build storing into the cache, then one restoring it
+ *   ninja   a full build, and a no-op rebuild of it (best)
+ *
+ * Results go to --out as JSON, one entry per project.
+ *
+ *   cc -O2 -I.. -o suite suite.c && ./suite [--sizes 1000,10000,100000]
+ *       [--shapes wide,deep] [--fanin 8] [--runs 5] [--dir /tmp/nobuild-bench]
+ *       [--out bench.json] [--no-ninja]
+ */
+#define NOB_IMPL 0
+#include "nobuild.h"
+
+#define BENCH_PER_DIR     500   /* Sources per directory. */
+#define BENCH_LIBS        32    /* Libraries of a deep project. */
+#define BENCH_SPAWNS      2000  /* __spawn() calls measured. */
+
+typedef struct {
+    const char* dir;
+    const char* shape;
+    int ntus;
+    int fanin;
+    int nheaders;
+    int runs;
+    int ninja;
+} bench_t;
+
+/************************************************************
+ * Stub Compiler
+ ************************************************************/
+
+/**
+ * Writes the lines `#include "<name>"` of 'src' as 'include/<name>' into
+ * 'out', each preceded by 'sep'.
+ */
+static void stub_includes(const char* src, FILE* out, const char* sep)
+{
+    FILE* in = fopen(src, "r");
+    if (!in) {
+        return;
+    }
+    char line[512], name[256];
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "#include \"%255[^\"]\"", name) == 1) {
+            fprintf(out, "%sinclude/%s", sep, name);
+        }
+    }
+    fclose(in);
+}
+
+/**
+ * Behaves like `cc [-MMD -MF <dep>] -c -o <obj> <src>`, `cc -E <src>` and
+ * `cc -o <out> <inputs>` as far as a build system can tell.
+ */
+static int stub_cc(int argc, char** argv)
+{
+    const char *out = NULL, *dep = NULL, *target = NULL, *src = NULL;
+    int compile = 0, preprocess = 0;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+            out = argv[++a];
+        } else if (strcmp(argv[a], "-MF") == 0 && a + 1 < argc) {
+            dep = argv[++a];
+        } else if (strcmp(argv[a], "-MT") == 0 && a + 1 < argc) {
+            target = argv[++a];
+        } else if (strcmp(argv[a], "-c") == 0) {
+            compile = 1;
+        } else if (strcmp(argv[a], "-E") == 0) {
+            preprocess = 1;
+        } else if (argv[a][0] != '-') {
+            src = argv[a];
+        }
+    }
+
+    if (preprocess && src) {
+        printf("# %s\n", src);
+        stub_includes(src, stdout, "\n# ");
+        printf("\n");
+    }
+
+    if (dep && src) {
+        FILE* f = fopen(dep, "w");
+        if (!f) {
+            perror(dep);
+            return 1;
+        }
+        fprintf(f, "%s: %s", target ? target : out, src);
+        stub_includes(src, f, " \\\n ");
+        fprintf(f, "\n");
+        fclose(f);
+    }
+
+    if (out) {
+        FILE* f = fopen(out, "w");
+        if (!f) {
+            perror(out);
+            return 1;
+        }
+        fprintf(f, "%s %s\n", compile ? "object" : "binary", src ? src : "");
+        fclose(f);
+    }
+    return 0;
+}
+
+/************************************************************
+ * Project Generator
+ ************************************************************/
+
+static void source_path(int tu, char* path, size_t size)
+{
+    snprintf(path, size, "src/d%04d/f%06d.c", tu / BENCH_PER_DIR, tu);
+}
+
+static int bench_nlibs(const bench_t* b)
+{
+    if (strcmp(b->shape, "deep") != 0) {
+        return 0;
+    }
+    // Library rules need two sources: a target and a dependency.
+    return (b->ntus / 2 < BENCH_LIBS) ? b->ntus / 2 : BENCH_LIBS;
+}
+
+/**
+ * The headers included by 'tu': header 0, then picks skewed towards the
+ * low indices, so that fan-in ranges from every unit to a handful of them.
+ */
+static int tu_headers(const bench_t* b, int tu, int* headers)
+{
+    int n = 0;
+    uint64_t state = 0x9E3779B97F4A7C15ull * (uint64_t) (tu + 1);
+    headers[n++] = 0;
+    while (n < b->fanin && n < b->nheaders) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const double r = (double) (state >> 11) / (double) (1ull << 53);
+        const int h = (int) (r * r * r * b->nheaders);
+        int seen = 0;
+        for (int k = 0; k < n; k++) {
+            seen |= (headers[k] == h);
+        }
+        if (!seen) {
+            headers[n++] = h;
+        }
+    }
+    return n;
+}
+
+static short write_file(const char* path, const char* text)
+{
+    FILE* f = fopen(path, "w");
+    if (!f || fputs(text, f) < 0 || fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the sources, the headers and the './cc' stub of a project into
+ * the current directory, and a build.ninja building it into 'ninja/'.
+ */
+static short generate(const bench_t* b, const char* self)
+{
+    char path[256], text[4096];
+    if (mkdir("include", 0755) != 0 || mkdir("src", 0755) != 0 || mkdir("lib", 0755) != 0 ||
+        symlink(self, "cc") != 0) {
+        perror("generate");
+        return -1;
+    }
+
+    for (int h = 0; h < b->nheaders; h++) {
+        snprintf(path, sizeof(path), "include/h%04d.h", h);
+        snprintf(text, sizeof(text), "#pragma once\nint h%04d(void);\n", h);
+        if (write_file(path, text) != 0) {
+            return -1;
+        }
+    }
+
+    int* headers = (int*) malloc(b->fanin * sizeof(int));
+    for (int tu = 0; headers && tu < b->ntus; tu++) {
+        if (tu % BENCH_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "src/d%04d", tu / BENCH_PER_DIR);
+            mkdir(path, 0755);
+        }
+        int len = 0;
+        const int n = tu_headers(b, tu, headers);
+        for (int k = 0; k < n; k++) {
+            len += snprintf(text + len, sizeof(text) - len, "#include \"h%04d.h\"\n", headers[k]);
+        }
+        snprintf(text + len, sizeof(text) - len, "int f%06d(void) { return %d; }\n", tu, tu);
+        source_path(tu, path, sizeof(path));
+        if (write_file(path, text) != 0) {
+            free(headers);
+            return -1;
+        }
+    }
+    free(headers);
+    if (write_file("src/main.c", "#include \"h0000.h\"\nint main(void) { return 0; }\n") != 0 ||
+        write_file("src/version.c", "const char* version = \"bench\";\n") != 0) {
+        return -1;
+    }
+
+    if (!b->ninja) {
+        return 0;
+    }
+
+    FILE* f = fopen("build.ninja", "w");
+    if (!f) {
+        perror("build.ninja");
+        return -1;
+    }
+    fprintf(f, "rule cc\n"
+               "  command = ./cc -Iinclude -MMD -MF $out.d -c -o $out $in\n"
+               "  depfile = $out.d\n"
+               "  deps = gcc\n"
+               "rule ar\n"
+               "  command = rm -f $out && " NOB_AR " rcsD $out $in\n"
+               "rule link\n"
+               "  command = ./cc -o $out $in\n");
+
+    const int nlibs = bench_nlibs(b);
+    for (int tu = 0; tu < b->ntus; tu++) {
+        source_path(tu, path, sizeof(path));
+        fprintf(f, "build ninja/%.*s.o: cc %s\n", (int) strlen(path) - 2, path, path);
+    }
+    fprintf(f, "build ninja/src/main.o: cc src/main.c\n"
+               "build ninja/src/version.o: cc src/version.c\n");
+
+    for (int l = 0; l < nlibs; l++) {
+        fprintf(f, "build ninja/lib/lib%02d.a: ar", l);
+        for (int tu = l * b->ntus / nlibs; tu < (l + 1) * b->ntus / nlibs; tu++) {
+            source_path(tu, path, sizeof(path));
+            fprintf(f, " ninja/%.*s.o", (int) strlen(path) - 2, path);
+        }
+        // Archived after the previous library, as DEPENDS_ON() does.
+        if (l > 0) {
+            fprintf(f, " || ninja/lib/lib%02d.a", l - 1);
+        }
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "build ninja/app: link ninja/src/main.o ninja/src/version.o");
+    for (int l = nlibs - 1; l >= 0; l--) {
+        fprintf(f, " ninja/lib/lib%02d.a", l);
+    }
+    for (int tu = 0; nlibs == 0 && tu < b->ntus; tu++) {
+        source_path(tu, path, sizeof(path));
+        fprintf(f, " ninja/%.*s.o", (int) strlen(path) - 2, path);
+    }
+    fprintf(f, "\ndefault ninja/app\n");
+
+    if (fclose(f) != 0) {
+        perror("build.ninja");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Declares the rules of the project, returning the root one.
+ */
+static build_rule_t* declare(const bench_t* b, int* nrules)
+{
+    compiler_t* cc;
+    INIT_CC(cc);
+    SET_CC(cc, "./cc");
+
+    flag_t* flags = NULL;
+    ADD_FLAG(&flags, FLAG("-Iinclude"));
+
+    char path[256];
+    const int nlibs = bench_nlibs(b);
+    build_rule_t* prev = NULL;
+    object_t* deps = NULL;
+    for (int l = 0; l < nlibs; l++) {
+        const int first = l * b->ntus / nlibs, last = (l + 1) * b->ntus / nlibs;
+        object_t* lib_deps = NULL;
+        for (int tu = first + 1; tu < last; tu++) {
+            source_path(tu, path, sizeof(path));
+            ADD_OBJECT(&lib_deps, OBJECT(path));
+        }
+        // Rules keep their target: a list of one copies its name.
+        object_t* target = NULL;
+        source_path(first, path, sizeof(path));
+        ADD_OBJECT(&target, OBJECT(path));
+
+        build_rule_t* lib;
+        INIT_RULE(lib);
+        snprintf(path, sizeof(path), "lib/lib%02d.a", l);
+        MAKE_RULE(lib, cc, flags, target, lib_deps, path);
+        SET_MODE(lib, BUILD_MODE_SPLIT);
+        SET_KIND(lib, RULE_STATIC_LIB);
+        if (prev) {
+            DEPENDS_ON(lib, prev);
+        }
+        prev = lib;
+    }
+    ADD_OBJECT(&deps, OBJECT("src/version.c"));
+    for (int tu = 0; nlibs == 0 && tu < b->ntus; tu++) {
+        source_path(tu, path, sizeof(path));
+        ADD_OBJECT(&deps, OBJECT(path));
+    }
+
+    object_t* target = NULL;
+    ADD_OBJECT(&target, OBJECT("src/main.c"));
+    build_rule_t* app;
+    INIT_RULE(app);
+    MAKE_RULE(app, cc, flags, target, deps, "app");
+    SET_MODE(app, BUILD_MODE_SPLIT);
+    if (prev) {
+        DEPENDS_ON(app, prev);
+    }
+    *nrules = nlibs + 1;
+    return app;
+}
+
+/************************************************************
+ * Measurements
+ ************************************************************/
+
+static double ms_since(long long start)
+{
+    return (__now_us() - start) / 1000.0;
+}
+
+/**
+ * Runs 'argv' to completion with its output discarded. Returns its exit
+ * status, or -1.
+ */
+static int run_quiet(char** argv)
+{
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    pid_t pid = __spawn(argv, null);
+    if (null >= 0) {
+        close(null);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Deletes the object of every source, so that the next build compiles
+ * them all again.
+ */
+static void remove_objects(const bench_t* b)
+{
+    char path[256], object[256];
+    for (int tu = 0; tu < b->ntus; tu++) {
+        source_path(tu, path, sizeof(path));
+        if (__object_path(path, object, sizeof(object)) == 0) {
+            unlink(object);
+        }
+    }
+    unlink("src/main.o");
+    unlink("src/version.o");
+}
+
+/**
+ * Measures one project in the current directory, writing its results as a
+ * JSON object to 'out'. Returns 0 if every build succeeded.
+ */
+static short measure(const bench_t* b, const char* self, FILE* out)
+{
+    long long start = __now_us();
+    if (generate(b, self) != 0) {
+        return -1;
+    }
+    const double generate_ms = ms_since(start);
+
+    start = __now_us();
+    int nrules = 0;
+    build_rule_t* app = declare(b, &nrules);
+    const double declare_ms = ms_since(start);
+
+    double sort_ms = -1, plan_ms = -1;
+    int njobs = 0;
+    for (int r = 0; r < b->runs; r++) {
+        build_rule_t** order = NULL;
+        int n = 0, capacity = 0;
+        __job_t* jobs = NULL;
+
+        start = __now_us();
+        if (__graph_sort(app, &order, &n, &capacity) != 0) {
+            return -1;
+        }
+        const double sorted = ms_since(start);
+
+        start = __now_us();
+        if (__plan_graph(order, n, &jobs, &njobs) != 0) {
+            return -1;
+        }
+        const double planned = ms_since(start);
+
+        __graph_reset(app);
+        __jobs_free(jobs, njobs);
+        free(order);
+        sort_ms = (sort_ms < 0 || sorted < sort_ms) ? sorted : sort_ms;
+        plan_ms = (plan_ms < 0 || planned < plan_ms) ? planned : plan_ms;
+    }
+
+    char* args[] = { (char*) "true", NULL };
+    start = __now_us();
+    for (int s = 0; s < BENCH_SPAWNS; s++) {
+        int status = 0;
+        pid_t pid = __spawn(args, -1);
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+            return -1;
+        }
+    }
+    const double spawn_us = (__now_us() - start) / (double) BENCH_SPAWNS;
+
+    start = __now_us();
+    short result = BUILD(app);
+    const double build_ms = ms_since(start);
+
+    double noop_ms = -1;
+    for (int r = 0; r < b->runs && result == 0; r++) {
+        start = __now_us();
+        result = BUILD(app);
+        const double elapsed = ms_since(start);
+        noop_ms = (noop_ms < 0 || elapsed < noop_ms) ? elapsed : noop_ms;
+    }
+
+    double store_ms = -1, hit_ms = -1;
+    if (result == 0) {
+        SET_CACHE("cache", 0);
+        remove_objects(b);
+        start = __now_us();
+        result = BUILD(app);
+        store_ms = ms_since(start);
+
+        remove_objects(b);
+        start = __now_us();
+        result = (result == 0) ? BUILD(app) : result;
+        hit_ms = ms_since(start);
+    }
+    cleanup(app);
+
+    double ninja_build_ms = -1, ninja_noop_ms = -1;
+    if (b->ninja && result == 0) {
+        char jobs[16];
+        snprintf(jobs, sizeof(jobs), "%d", __jobs_limit());
+        char* ninja[] = { (char*) "ninja", (char*) "-j", jobs, NULL };
+
+        start = __now_us();
+        result = (run_quiet(ninja) == 0) ? 0 : -1;
+        ninja_build_ms = ms_since(start);
+        for (int r = 0; r < b->runs && result == 0; r++) {
+            start = __now_us();
+            result = (run_quiet(ninja) == 0) ? 0 : -1;
+            const double elapsed = ms_since(start);
+            ninja_noop_ms = (ninja_noop_ms < 0 || elapsed < ninja_noop_ms) ? elapsed : ninja_noop_ms;
+        }
+    }
+
+    fprintf(out,
+            "{\"shape\":\"%s\",\"tus\":%d,\"headers\":%d,\"fanin\":%d,\"rules\":%d,\"jobs\":%d,"
+            "\"job_slots\":%d,\"ok\":%s,\"generate_ms\":%.3f,"
+            "\"graph\":{\"declare_ms\":%.3f,\"sort_ms\":%.3f},"
+            "\"plan\":{\"ms\":%.3f,\"us_per_job\":%.3f},"
+            "\"spawn\":{\"us\":%.2f,\"per_s\":%.0f},"
+            "\"build\":{\"ms\":%.3f,\"jobs_per_s\":%.0f,\"noop_ms\":%.3f,\"noop_us_per_job\":%.3f},"
+            "\"cache\":{\"store_ms\":%.3f,\"hit_ms\":%.3f,\"hit_us_per_job\":%.3f},",
+            b->shape, b->ntus, b->nheaders, b->fanin, nrules, njobs, __jobs_limit(), result == 0 ? "true" : "false",
+            generate_ms, declare_ms, sort_ms, plan_ms, 1000.0 * plan_ms / njobs, spawn_us, 1e6 / spawn_us,
+            build_ms, 1000.0 * njobs / build_ms, noop_ms, 1000.0 * noop_ms / njobs,
+            store_ms, hit_ms, 1000.0 * hit_ms / njobs);
+    if (b->ninja) {
+        fprintf(out, "\"ninja\":{\"build_ms\":%.3f,\"noop_ms\":%.3f}}", ninja_build_ms, ninja_noop_ms);
+    } else {
+        fprintf(out, "\"ninja\":null}");
+    }
+    return result;
+}
+
+/**
+ * Measures a project in a fresh directory and a forked process, since
+ * nobuild keeps its settings and build database per process. Its JSON
+ * object is appended to 'out'.
+ */
+static short measure_forked(const bench_t* b, const char* self, FILE* out)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/%s-%d", b->dir, b->shape, b->ntus);
+    char* rm[] = { (char*) "rm", (char*) "-rf", dir, NULL };
+    if (run_quiet(rm) != 0 || mkdir(dir, 0755) != 0) {
+        perror(dir);
+        return -1;
+    }
+
+    fflush(out);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        FILE* result = fdopen(fds[1], "w");
+        if (!result || chdir(dir) != 0) {
+            _exit(1);
+        }
+        // Builds print nothing: keep the terminal for errors.
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+        }
+        const short status = measure(b, self, result);
+        fclose(result);
+        _exit(status == 0 ? 0 : 1);
+    }
+    close(fds[1]);
+
+    char buffer[4096];
+    size_t total = 0;
+    for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) != 0;) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        fwrite(buffer, 1, n, out);
+        total += n;
+    }
+    close(fds[0]);
+    if (total == 0) {
+        fprintf(out, "null");
+    }
+
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "suite: %s project of %d units failed\n", b->shape, b->ntus);
+        return -1;
+    }
+    return 0;
+}
+
+static int in_path(const char* program)
+{
+    char path[PATH_MAX];
+    const char* dirs = getenv("PATH");
+    while (dirs && *dirs) {
+        size_t len = strcspn(dirs, ":");
+        snprintf(path, sizeof(path), "%.*s/%s", (int) len, dirs, program);
+        if (access(path, X_OK) == 0) {
+            return 1;
+        }
+        dirs += len + (dirs[len] == ':');
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* base = strrchr(argv[0], '/');
+    if (strcmp(base ? base + 1 : argv[0], "cc") == 0) {
+        return stub_cc(argc, argv);
+    }
+
+    const char* sizes  = "1000,10000,100000";
+    const char* shapes = "wide,deep";
+    const char* path   = "bench.json";
+    bench_t b = { "/tmp/nobuild-bench", NULL, 0, 8, 0, 5, 1 };
+    for (int a = 1; a < argc; a++) {
+        const int value = (a + 1 < argc);
+        if (strcmp(argv[a], "--sizes") == 0 && value) {
+            sizes = argv[++a];
+        } else if (strcmp(argv[a], "--shapes") == 0 && value) {
+            shapes = argv[++a];
+        } else if (strcmp(argv[a], "--fanin") == 0 && value) {
+            b.fanin = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--runs") == 0 && value) {
+            b.runs = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--dir") == 0 && value) {
+            b.dir = argv[++a];
+        } else if (strcmp(argv[a], "--out") == 0 && value) {
+            path = argv[++a];
+        } else if (strcmp(argv[a], "--no-ninja") == 0) {
+            b.ninja = 0;
+        } else {
+            fprintf(stderr, "usage: %s [--sizes N,...] [--shapes wide,deep] [--fanin N] [--runs N] "
+                            "[--dir DIR] [--out FILE] [--no-ninja]\n", argv[0]);
+            return 2;
+        }
+    }
+    b.fanin = (b.fanin > 0) ? b.fanin : 1;
+    b.runs  = (b.runs > 0) ? b.runs : 1;
+    if (b.ninja && !in_path("ninja")) {
+        fprintf(stderr, "suite: ninja not found, measuring nobuild only\n");
+        b.ninja = 0;
+    }
+
+    char self[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len <= 0) {
+        perror("readlink");
+        return 1;
+    }
+    self[len] = '\0';
+    mkdir(b.dir, 0755);
+
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "{\"cpus\":%ld,\"job_slots\":%d,\"runs\":%d,\"projects\":[\n",
+            sysconf(_SC_NPROCESSORS_ONLN), __jobs_limit(), b.runs);
+
+    int failed = 0, count = 0;
+    for (const char* s = shapes; *s;) {
+        char shape[16];
+        const size_t slen = strcspn(s, ",");
+        snprintf(shape, sizeof(shape), "%.*s", (int) slen, s);
+        s += slen + (s[slen] == ',');
+
+        for (const char* n = sizes; *n;) {
+            b.shape    = shape;
+            b.ntus     = atoi(n);
+            b.nheaders = (b.ntus / 10 > 64) ? b.ntus / 10 : 64;
+            n += strcspn(n, ",");
+            n += (*n == ',');
+            if (b.ntus <= 0) {
+                continue;
+            }
+
+            printf("suite: %s project of %d units...\n", shape, b.ntus);
+            fflush(stdout);
+            fprintf(out, "%s", (count++ > 0) ? ",\n" : "");
+            failed |= (measure_forked(&b, self, out) != 0);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        perror(path);
+        return 1;
+    }
+    printf("suite: results in '%s'\n", path);
+    return failed ? 1 : 0;
+}
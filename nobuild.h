@@ -29,11 +29,45 @@
 #ifndef __NOBUILD_H__
 #define __NOBUILD_H__
 
+// Beyond ISO C, nobuild uses POSIX and a few GNU/Linux extensions (pipe2(),
+// SCM_RIGHTS, pidfds, ...), which a strict -std= hides. This only takes
+// effect if nobuild.h comes before any system header.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#ifndef NOB_NO_THREADS
+#include <pthread.h>
+#endif
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>       // FICLONE
+#include <sys/ioctl.h>
+#include <sys/syscall.h>    // SYS_pidfd_open
+#include <sys/inotify.h>
+#include <elf.h>
+#endif
+
 // The nobuild philosophy follows the idea that "less is more". Still, sometimes
 // "cutting too much" is  not the best approach.  That's why we aim  to keep at
 // least basic compatibility with both C and C++ compilers, so nobuild can work
@@ -66,17 +100,32 @@
  * details and may change in future versions.
  */
 typedef struct __flag {
-    char name[FLAG_CAPACITY];   /** The flag text (e.g., "-Wall", "-O2", ...). */
+    const char* name;           /** The flag text (e.g., "-Wall", "-O2", ...). */
     struct __flag *__next;      /** Pointer to the next flag in the linked list (private). */
+    struct __flag *__tail;      /** Last flag of the list, kept on its head only (private). */
+    int __count;                /** Length of the list, kept on its head only (private). */
 } flag_t;
 
+/**
+ * @enum lto_mode_t
+ * @brief Selects link-time optimization for the rules of a compiler_t.
+ */
+typedef enum __lto_mode {
+    LTO_NONE = 0,   /** No link-time optimization (default). */
+    LTO_FULL,       /** `-flto`: the whole program is optimized at link time. */
+    LTO_THIN,       /** `-flto=thin` with clang; same as LTO_FULL with gcc. */
+} lto_mode_t;
+
 /**
  * @struct compiler_t
  * @brief Represents a compiler command and its associated flags.
  */
 typedef struct __compiler {
     char cmd[CC_CAPACITY];      /** The compiler executable name (e.g., "gcc" or "clang"). */
-    struct __flag *flags;       /** Linked list of compiler flags. */
+    struct __flag *flags;       /** Linked list of compiler flags (not used by MAKE_RULE()). */
+    int __refs;                 /** Number of rules using the compiler (private). */
+    char ld[CC_CAPACITY];       /** Linker passed to -fuse-ld= (e.g., "mold" or "lld"), empty for the default. */
+    lto_mode_t lto;             /** Link-time optimization of the rules using the compiler. */
 } compiler_t;
 
 /**
@@ -89,10 +138,85 @@ typedef struct __compiler {
  * Field '__next' is used to build chains of object dependencies.
  */
 typedef struct __object {
-    char name[OBJECT_CAPACITY];     /** The object name or file path. */
+    const char* name;               /** The object name or file path. */
     struct __object *__next;        /** Pointer to the next object in the linked list (private). */
+    struct __object *__tail;        /** Last object of the list, kept on its head only (private). */
+    int __count;                    /** Length of the list, kept on its head only (private). */
 } object_t;
 
+/**
+ * @enum build_mode_t
+ * @brief Selects how a build rule turns its sources into the output.
+ */
+typedef enum __build_mode {
+    BUILD_MODE_SINGLE = 0,  /** One compiler invocation: `cc ... -o out main.c foo.c` (default). */
+    BUILD_MODE_SPLIT,       /** One `cc -c` per source into its own `.o`, then a link step. */
+    BUILD_MODE_PCH,         /** Precompiles the target header (see MAKE_PCH()). */
+} build_mode_t;
+
+/**
+ * @enum rule_kind_t
+ * @brief Selects what the final step of a build rule produces.
+ */
+typedef enum __rule_kind {
+    RULE_EXECUTABLE = 0,    /** `cc ... -o out` (default). */
+    RULE_STATIC_LIB,        /** `ar rcsD out <objects>`; sources are always compiled on their own. */
+    RULE_SHARED_LIB,        /** `cc -shared -Wl,-soname,<name> -o out`, compiling with -fPIC. */
+} rule_kind_t;
+
+/**
+ * @struct rule_dep_t
+ * @brief Links a build rule to another rule whose output it consumes.
+ *
+ * @note Fields starting with '__' are private implementation
+ * details and may change in future versions.
+ */
+typedef struct __rule_dep {
+    struct __build_rule* rule;      /** The rule that has to be built first. */
+    struct __rule_dep *__next;      /** Pointer to the next dependency in the linked list (private). */
+} rule_dep_t;
+
+/**
+ * @enum check_mode_t
+ * @brief Selects how nobuild decides whether an output is up to date.
+ */
+typedef enum __check_mode {
+    CHECK_MTIME = 0,        /** Output newer than every input (default). */
+    CHECK_HASH,             /** Inputs have the same contents as in the last build. */
+} check_mode_t;
+
+/**
+ * @struct cache_backend_t
+ * @brief A shared store for the compilation cache.
+ *
+ * Both callbacks move a batch of 'n' blobs, named by 'names', to or from
+ * the local files 'paths', and return 0 only if the whole batch succeeded.
+ * They always run in a forked helper process, so they may block.
+ */
+typedef struct __cache_backend {
+    int (*get)(void* ctx, int n, const char* const* names, const char* const* paths);
+    int (*put)(void* ctx, int n, const char* const* names, const char* const* paths);
+    void* ctx;                      /** Passed back to the callbacks. */
+} cache_backend_t;
+
+/**
+ * @struct executor_t
+ * @brief Runs compile jobs on other machines.
+ *
+ * 'compile' gets the command line of a split-mode compile job
+ * (`cc <flags> -MMD -MF <dep> -c -o <obj> <src>`) along with its source
+ * and object, and has to produce the object and the depfile just like the
+ * command would. It returns the compiler's exit status, its diagnostics
+ * written to stderr, or -1 to have the job run locally instead, once a
+ * local job slot is free (e.g. when every worker is busy). It always runs
+ * in a forked helper process, one per job, so it may block.
+ */
+typedef struct __executor {
+    int (*compile)(void* ctx, char* const* argv, const char* source, const char* object);
+    int slots;                      /** Jobs it takes at once, on top of the local job slots. */
+    void* ctx;                      /** Passed back to the callback. */
+} executor_t;
+
 /**
  * @struct build_rule_t
  * @brief Represents a build rule linking targets, dependencies
@@ -103,6 +227,15 @@ typedef struct __build_rule {
     struct __object* dependencies;  /** Linked list of objects whose 'target' depends on. */
     struct __compiler* cc;          /** Compiler configuration to use. */
     char output[OUT_CAPACITY];      /** The name or path of the generated output file. */
+    build_mode_t mode;              /** How sources are compiled (see build_mode_t). */
+    rule_kind_t kind;               /** What the final step produces (see rule_kind_t). */
+    struct __rule_dep* upstream;    /** Linked list of rules whose outputs this rule consumes. */
+    int __visit;                    /** Graph traversal state (private). */
+    int __final;                    /** Index of the rule's last job while building (private). */
+    struct __flag_set* __flags;     /** Interned `cc <flags>` argv prefix (private). */
+    int unity;                      /** Unity batch size: 0 (off), > 0 or UNITY_AUTO. */
+    struct __object* unity_exclude; /** Sources never batched in unity mode. */
+    struct __build_rule* pch;       /** Precompiled header rule used by every compile (see USE_PCH()). */
 } build_rule_t;
 
 
@@ -114,10 +247,10 @@ typedef struct __build_rule {
 /**
  * @brief Allocates an anonymous flag_t object.
  */
-#define FLAG(__FLAG__)      ((flag_t) { (__FLAG__), NULL })
+#define FLAG(__FLAG__)      ((flag_t) { (__FLAG__), NULL, NULL, 0 })
 
-#define COMPILER(__NAME__)  ((compiler_t) { (__NAME__), NULL })
-#define OBJECT(__NAME__)    ((object_t)   { (__NAME__), NULL })
+#define COMPILER(__NAME__)  ((compiler_t) { (__NAME__), NULL, 0 })
+#define OBJECT(__NAME__)    ((object_t)   { (__NAME__), NULL, NULL, 0 })
 
 
 
@@ -131,6 +264,9 @@ typedef struct __build_rule {
 #define INIT_CC(__CC_PTR__)                                         \
     (__CC_PTR__) = (compiler_t*) malloc(sizeof(compiler_t));        \
     (__CC_PTR__)->flags = NULL;                                     \
+    (__CC_PTR__)->__refs = 0;                                       \
+    (__CC_PTR__)->ld[0] = '\0';                                     \
+    (__CC_PTR__)->lto = LTO_NONE;                                   \
     memset((__CC_PTR__)->cmd, '\0', sizeof(*((__CC_PTR__)->cmd)));
 
 /**
@@ -141,6 +277,15 @@ typedef struct __build_rule {
     (__RULE_PTR__)->target = NULL;                                          \
     (__RULE_PTR__)->dependencies = NULL;                                    \
     (__RULE_PTR__)->cc = NULL;                                              \
+    (__RULE_PTR__)->mode = BUILD_MODE_SINGLE;                               \
+    (__RULE_PTR__)->kind = RULE_EXECUTABLE;                                 \
+    (__RULE_PTR__)->upstream = NULL;                                        \
+    (__RULE_PTR__)->__visit = 0;                                            \
+    (__RULE_PTR__)->__final = 0;                                            \
+    (__RULE_PTR__)->__flags = NULL;                                         \
+    (__RULE_PTR__)->unity = 0;                                              \
+    (__RULE_PTR__)->unity_exclude = NULL;                                   \
+    (__RULE_PTR__)->pch = NULL;                                             \
     memset((__RULE_PTR__)->output, '\0', sizeof(*((__RULE_PTR__)->output)));
 
 
@@ -158,6 +303,36 @@ typedef struct __build_rule {
 #define SET_CC(__CC_PTR__, __CC_STR__)                      \
     strncpy((__CC_PTR__)->cmd, (__CC_STR__),  CC_CAPACITY);
 
+/**
+ * @brief Sets the linker of a compiler_t, passed as `-fuse-ld=<name>`.
+ *
+ * Links through "mold" or "lld" run on as many threads as there are job
+ * slots, which they take up while running: no compile job starts that
+ * would oversubscribe the machine.
+ *
+ * @param __CC_PTR__ Pointer to the compiler_t object.
+ * @param __LD_STR__ Linker name (e.g., "mold", "lld", "gold").
+ */
+#define SET_LD(__CC_PTR__, __LD_STR__)                      \
+    strncpy((__CC_PTR__)->ld, (__LD_STR__), CC_CAPACITY - 1);
+
+/**
+ * @brief Enables link-time optimization for the rules using a compiler_t.
+ *
+ * Every compile gets `-flto` (`-flto=thin` with clang and LTO_THIN) and
+ * links parallelize their code generation over the job slots: gcc through
+ * `-flto=<jobs>`, clang through `-flto-jobs=<jobs>`. ThinLTO links keep
+ * their incremental cache under '<cache dir>/thinlto' when the compilation
+ * cache is enabled. Partitioned links (gcc, ThinLTO) take up every job
+ * slot while running. Static libraries of LTO objects need an archiver
+ * with the plugin, e.g. -DNOB_AR='"gcc-ar"' or '"llvm-ar"'.
+ *
+ * @param __CC_PTR__ Pointer to the compiler_t object.
+ * @param __MODE__   One of the lto_mode_t values.
+ */
+#define SET_LTO(__CC_PTR__, __MODE__)                       \
+    ((__CC_PTR__)->lto = (__MODE__));
+
 /**
  * @brief Sets the output file path in a build_rule_t.
  *
@@ -167,6 +342,66 @@ typedef struct __build_rule {
 #define SET_OUT(__RULE_PTR__, __OUT_STR__)                      \
     strncpy((__RULE_PTR__)->output, (__OUT_STR__), CC_CAPACITY);
 
+/**
+ * @brief Sets the build mode of a build_rule_t.
+ *
+ * With BUILD_MODE_SPLIT every source (target and dependencies) is compiled
+ * to its own object file, placed next to the source with the extension
+ * replaced by ".o" (e.g., "test/foo.c" -> "test/foo.o"), and only the final
+ * link step consumes the objects.
+ *
+ * @param __RULE_PTR__  Pointer to the build_rule_t object.
+ * @param __MODE__      One of the build_mode_t values.
+ */
+#define SET_MODE(__RULE_PTR__, __MODE__)                        \
+    ((__RULE_PTR__)->mode = (__MODE__));
+
+/**
+ * @brief Sets what a build_rule_t produces: an executable, a static or a
+ *        shared library.
+ *
+ * Library rules are meant to be consumed through DEPENDS_ON(). A rule
+ * consuming a static library also links the libraries that one depends
+ * on. A rule consuming a shared library is only relinked when the
+ * library's interface changes: every shared link writes '<output>.toc',
+ * holding a hash of the symbols the library exports, and rewrites it only
+ * when that set changed. Archives are created with NOB_AR (default "ar");
+ * those linked into shared libraries need -fPIC among their flags.
+ *
+ * @param __RULE_PTR__  Pointer to the build_rule_t object.
+ * @param __KIND__      One of the rule_kind_t values.
+ */
+#define SET_KIND(__RULE_PTR__, __KIND__)                        \
+    ((__RULE_PTR__)->kind = (__KIND__));
+
+#ifndef NOB_AR
+#define NOB_AR "ar"
+#endif
+
+/**
+ * @brief Batch size letting SET_UNITY() pick one batch per job slot.
+ */
+#define UNITY_AUTO (-1)
+
+/**
+ * @brief Enables unity (jumbo) compilation of a BUILD_MODE_SPLIT rule.
+ *
+ * Sources sharing an extension are grouped, in declaration order, into
+ * contiguous batches of at most '__SIZE__' files (sizes are evened out),
+ * and each batch is compiled as a single generated source placed in
+ * '<output>.unity/' that #includes its members. Only batches whose members
+ * (or their headers) changed are rebuilt. Sources that are not unity-safe
+ * (e.g. clashing static symbols) can be listed in '__EXCLUDE__', they are
+ * compiled on their own.
+ *
+ * @param __RULE_PTR__  Pointer to the build_rule_t object.
+ * @param __SIZE__      Files per batch, UNITY_AUTO, or 0 to disable.
+ * @param __EXCLUDE__   List of objects (sources) to keep out of batches, or NULL.
+ */
+#define SET_UNITY(__RULE_PTR__, __SIZE__, __EXCLUDE__)          \
+    ((__RULE_PTR__)->unity = (__SIZE__),                        \
+     (__RULE_PTR__)->unity_exclude = (__EXCLUDE__));
+
 
 
 
@@ -177,6 +412,11 @@ typedef struct __build_rule {
 /**
  * @brief Adds a flag to a list of flags.
  *
+ * The flag text is copied, so it may live in a temporary buffer, and the
+ * length of flag and object names is not limited. MAKE_RULE() and
+ * MAKE_PCH() take a copy of the list, so add flags before calling them:
+ * flags added afterwards do not reach that rule.
+ *
  * @param __flags   Pointer to the head of the flag list.
  * @param __flag    The flag to add.
  */
@@ -190,9 +430,32 @@ LINKAGE void ADD_FLAG(flag_t **__flags, const flag_t __flag);
  */
 LINKAGE void ADD_OBJECT(object_t **__objects, const object_t __object);
 
+/**
+ * @brief Adds every file matching a glob pattern to a list of objects.
+ *
+ * Components of 'pattern' are matched with fnmatch(3) (so '*', '?' and
+ * '[...]' never match a '/' or a leading '.'), and a "**" component
+ * matches any number of directories: with "src", "**" and "*.cpp" as its
+ * components, a pattern finds every .cpp file below src. A pattern ending
+ * with "**" matches every file below it. Hidden directories, and symbolic
+ * links to directories, are not entered by "**". The tree is walked by up
+ * to 8 threads (see SET_JOBS()); files are added in sorted order, each
+ * once.
+ *
+ * @param __objects Pointer to the head of the object list.
+ * @param pattern   Pattern relative to the current directory, or absolute.
+ * @return Number of objects added, or -1 on error.
+ */
+LINKAGE int GLOB_OBJECTS(object_t **__objects, const char* pattern);
+
 /**
  * @brief Creates a build rule with the given parameters.
  *
+ * The compiler command and '__flags' are copied into the rule's command
+ * line when it is made: flags added to the list later are ignored by it,
+ * until MAKE_RULE() is called again. The target and dependency lists are
+ * used in place.
+ *
  * @param __rule        Pointer to the build rule to populate.
  * @param __compiler    Compiler configuration to use.
  * @param __flags       List of compiler flags.
@@ -202,226 +465,7068 @@ LINKAGE void ADD_OBJECT(object_t **__objects, const object_t __object);
  */
 LINKAGE void MAKE_RULE(build_rule_t *__rule, compiler_t *__compiler, flag_t *__flags, object_t* __target, object_t* __dependencies, const char* output);
 
+/**
+ * @brief Creates a rule precompiling a header.
+ *
+ * The header is compiled as `cc <flags> -x <c|c++>-header -o <output>
+ * <header>`, C++ being picked from the extension (.hpp, .hh, .hxx, .H) or
+ * a C++ compiler name (e.g. "g++", "clang++"). For gcc the output must be
+ * named '<something>.gch', for clang '<something>.pch'. The PCH is rebuilt
+ * whenever the header or anything it includes changes. The flags should
+ * match the ones of the rules using it, or the compiler ignores it.
+ *
+ * @param __rule        Pointer to the build rule to populate.
+ * @param __compiler    Compiler configuration to use.
+ * @param __flags       List of compiler flags.
+ * @param __header      Header to precompile.
+ * @param output        Output file path (e.g. "build/common.h.gch").
+ */
+LINKAGE void MAKE_PCH(build_rule_t *__rule, compiler_t *__compiler, flag_t *__flags, object_t* __header, const char* output);
+
+/**
+ * @brief Makes every compile of a build rule use a precompiled header.
+ *
+ * Each compile job of '__rule' gets `-include <output minus .gch>` (gcc,
+ * which then finds the .gch) or `-include-pch <output>` (clang), waits for
+ * the PCH to be built and is rebuilt when it changes. Unless the .gch sits
+ * next to its header, building the MAKE_PCH() rule writes a stub in place
+ * of the header, which #includes the real one for when gcc rejects the
+ * PCH (and for `cc -E`).
+ *
+ * @param __rule    The consuming rule.
+ * @param __pch     A rule created with MAKE_PCH().
+ */
+LINKAGE void USE_PCH(build_rule_t *__rule, build_rule_t *__pch);
+
+/**
+ * @brief Declares that a build rule consumes the output of another rule.
+ *
+ * The output of '__dependency' is appended to the inputs of the final step
+ * of '__rule' (the link in BUILD_MODE_SPLIT, the only compiler invocation
+ * otherwise), e.g. an object or a library feeding an executable. Building
+ * '__rule' builds '__dependency' first; compiles of '__rule' itself do not
+ * wait for it. A static library (see SET_KIND()) only passes its own
+ * dependencies on to the rules linking it.
+ *
+ * @param __rule        The consuming rule.
+ * @param __dependency  The rule that has to be built first.
+ */
+LINKAGE void DEPENDS_ON(build_rule_t *__rule, build_rule_t *__dependency);
+
 /**
  * @brief Executes the build process according to a build rule.
  *
+ * Rules reachable through DEPENDS_ON() are built too, as one dependency
+ * graph whose jobs share the parallel job pool.
+ *
  * @param rule Pointer to the build rule to execute.
  * @return 0 on success, non-zero on failure.
  */
 LINKAGE short BUILD(build_rule_t* rule);
 
+/**
+ * @brief Executes several build rules (and the rules they depend on) as a
+ *        single dependency graph.
+ *
+ * @param rules  Array of build rules to execute, none of them NULL.
+ * @param nrules Number of entries in 'rules'.
+ * @return 0 on success, non-zero on failure.
+ */
+LINKAGE short BUILD_ALL(build_rule_t** rules, int nrules);
+
+/**
+ * @brief Builds like BUILD_ALL(), then keeps rebuilding whenever a source
+ *        or a header the sources include is saved.
+ *
+ * The dependency graph and the build database stay in memory, and the
+ * directories of every input are watched with inotify. Changes are
+ * batched until none came for a short while; then only the jobs reading a
+ * changed file, and those downstream of them, are checked and run again.
+ * Adding rules or sources needs a restart. Meant for a `--watch` option of
+ * the build program:
+ *
+ *     if (argc > 1 && strcmp(argv[1], "--watch") == 0) return WATCH(rules, n);
+ *
+ * @param rules  Array of build rules to execute.
+ * @param nrules Number of entries in 'rules'.
+ * @return Only returns, with a non-zero value, if watching fails.
+ */
+LINKAGE short WATCH(build_rule_t** rules, int nrules);
+
 /**
  * @brief Cleans up resources associated with a build rule.
  *
+ * Besides the rule and its compiler, this releases every list built with
+ * ADD_FLAG(), ADD_OBJECT() and DEPENDS_ON(). Those lists share a single
+ * arena, freed along with the last rule made by MAKE_RULE() or MAKE_PCH()
+ * that is cleaned up, so the other rules stay usable until then.
+ *
  * @param rule Pointer to the build rule to clean up.
  */
 LINKAGE void cleanup(build_rule_t* rule);
 
+/**
+ * @brief Sets the maximum number of compiler processes run in parallel.
+ *
+ * When never called (or called with a value <= 0), the limit is read from
+ * the NOB_JOBS environment variable and, failing that, defaults to the
+ * number of online processors.
+ *
+ * @param jobs Maximum number of concurrent jobs (<= 0 restores the default).
+ */
+LINKAGE void SET_JOBS(int jobs);
+
+/**
+ * @brief Holds back new jobs while the system load average is too high.
+ *
+ * Like `make -l`: no job is started while the 1-minute load average is at
+ * or above 'max_load', unless nothing is running. When never called, the
+ * limit is read from the NOB_LOAD environment variable.
+ *
+ * @param max_load Load average limit (<= 0 means no limit).
+ */
+LINKAGE void SET_LOAD(double max_load);
+
+/**
+ * @brief Limits the memory the running jobs are expected to use.
+ *
+ * Every output's peak memory use is recorded in the build database; a job
+ * is only started if its expected peak fits in the budget next to the
+ * running jobs and in the memory currently available (MemAvailable, or
+ * the room left under the cgroup v2 memory.max if smaller). A job is
+ * always started when nothing is running. When never called, the budget is
+ * read from the NOB_MEMORY environment variable (bytes, with an optional
+ * K/M/G suffix, or "off").
+ *
+ * @param budget Budget in bytes (0 selects 90% of the memory available
+ *               when the build starts, < 0 disables the check).
+ */
+LINKAGE void SET_MEMORY(long long budget);
+
+/**
+ * @brief Enables or disables the GNU make jobserver.
+ *
+ * When nobuild runs under `make -jN` (MAKEFLAGS carries --jobserver-auth,
+ * in either the 'fifo:PATH' or the 'R,W' form), every job but one first
+ * takes a token from make's jobserver, so the whole build tree stays at N
+ * concurrent jobs. Otherwise nobuild serves a jobserver of its own, with
+ * the job limit's worth of tokens, to the processes it spawns: sub-makes
+ * and `-flto=jobserver` links share its slots instead of adding their own.
+ * Enabled by default; when never called, NOB_JOBSERVER=0 disables it.
+ *
+ * @param enabled 0 to disable, any other value to enable.
+ */
+LINKAGE void SET_JOBSERVER(int enabled);
+
+/**
+ * @brief Records a trace of the build.
+ *
+ * Every job's start and end, time spent waiting in the ready queue, CPU
+ * time, peak memory use and outcome (run, fetched from the remote cache,
+ * restored from the local one, or up to date) are written to 'path' in the
+ * Chrome Trace Event Format, to be opened in chrome://tracing or Perfetto,
+ * and the slowest jobs are listed on stdout when the build ends. When never
+ * called, the path is read from the NOB_TRACE environment variable.
+ *
+ * @param path Trace file; NULL or "" disables tracing.
+ */
+LINKAGE void SET_TRACE(const char* path);
+
+/**
+ * @brief Sets the path of the compilation database.
+ *
+ * Before running any job, every build writes the command compiling each of
+ * its C, C++ and Objective-C sources to 'path', in the JSON format read by
+ * clangd and clang-tidy. Members of unity batches get the batch's command
+ * with their own path in place of the batch. The file is only rewritten
+ * when a command or the set of sources changed, which the build database
+ * keeps track of. It describes the graph of the last BUILD() or
+ * BUILD_ALL() call, so programs building several graphs get a complete
+ * database by passing all the roots to BUILD_ALL(). When never called, the
+ * path is read from the NOB_COMPDB environment variable and defaults to
+ * "compile_commands.json" in the current directory.
+ *
+ * @param path Database file path; NULL or "" disables it.
+ */
+LINKAGE void SET_COMPDB(const char* path);
+
+/**
+ * @brief Sets the path of the build database.
+ *
+ * The build database records, for every output, a hash of the command line
+ * that produced it together with the job's duration, so that changing a
+ * flag triggers a rebuild even when no file changed. When never called,
+ * the path is read from the NOB_DB environment variable and defaults to
+ * ".nobuild_db" in the current directory.
+ *
+ * @param path Database file path; NULL or "" disables the database.
+ */
+LINKAGE void SET_DB(const char* path);
+
+/**
+ * @brief Selects how outputs are checked for staleness.
+ *
+ * With CHECK_HASH an output is up to date when it was built by the same
+ * command line from inputs (sources and depfile-listed headers) whose
+ * contents hash to the same values as last time, no matter their mtimes.
+ * Hashes are memoized in the build database and only recomputed when an
+ * input's size or mtime changed. When never called, CHECK_HASH is selected
+ * by setting the NOB_CHECK environment variable to "hash".
+ *
+ * @param mode One of the check_mode_t values.
+ */
+LINKAGE void SET_CHECK(check_mode_t mode);
+
+/**
+ * @brief Enables the local compilation cache.
+ *
+ * Objects of split-mode compile jobs are stored in 'dir', keyed by the
+ * compiler identity, the command line and either the headers listed in the
+ * previous depfile or the preprocessed source. The depfile omits system
+ * headers, so the first key only notices those through the mtimes of the
+ * compiler's system include directories: a header edited in place there,
+ * without replacing the file, can still be served a stale object. A
+ * cache hit hard-links (or reflinks) the object out of the cache instead
+ * of running the compiler. The least recently used entries are evicted
+ * once the cache grows above 'max_size' bytes. When never called, the
+ * cache is configured from the NOB_CACHE_DIR and NOB_CACHE_SIZE (bytes,
+ * with an optional K/M/G suffix) environment variables.
+ *
+ * @param dir       Cache directory; NULL or "" disables the cache.
+ * @param max_size  Size limit in bytes (<= 0 selects 5 GiB).
+ */
+LINKAGE void SET_CACHE(const char* dir, long long max_size);
+
+/**
+ * @brief Selects a remote (shared) store for the compilation cache.
+ *
+ * The remote cache sits behind the local one, which must be enabled too:
+ * jobs missing locally are fetched by their direct key concurrently with
+ * local compiles, in helpers that do not take compile slots (and never
+ * run the compiler); a job still missing looks up its preprocessed key
+ * from the compile slot it then takes. Freshly compiled objects
+ * are uploaded in the background. The build waits for pending uploads
+ * before returning. When never called, an HTTP_CACHE() backend is created
+ * from the NOB_REMOTE_CACHE environment variable, if set.
+ *
+ * @param backend The store to use; NULL disables the remote cache.
+ */
+LINKAGE void SET_REMOTE_CACHE(const cache_backend_t* backend);
+
+/**
+ * @brief Creates a remote cache backend speaking HTTP/1.1.
+ *
+ * Blobs are read and written with GET/PUT on '<url>/ac/<64 hex digits>',
+ * compatible with bazel-remote started with --disable_http_ac_validation.
+ * Requests of a batch are pipelined on one connection.
+ *
+ * @param url Base URL, e.g. "http://cache.local:8080" (http:// only).
+ * @return The backend; its callbacks are NULL if the URL is not supported.
+ */
+LINKAGE cache_backend_t HTTP_CACHE(const char* url);
+
+/**
+ * @brief Sends compile jobs to an executor when the local job slots are
+ *        full.
+ *
+ * Up to the executor's 'slots' compiles then run besides the local ones,
+ * so the build goes as wide as the job pool and the executor together.
+ * Links, archives and compiles using a precompiled header always run
+ * locally. When never called, a TCP_EXECUTOR() is created from the
+ * NOB_WORKERS environment variable, if set.
+ *
+ * @param executor The executor to use; NULL disables remote execution.
+ */
+LINKAGE void SET_EXECUTOR(const executor_t* executor);
+
+/**
+ * @brief Creates an executor sending compiles to SERVE_WORKER() processes.
+ *
+ * Every job is preprocessed locally, which also writes its depfile, and
+ * the preprocessed source goes to a worker along with the command line;
+ * the worker sends back the object and the diagnostics. Connections are
+ * kept open across jobs, an idle one going to whichever job needs it
+ * next; new ones are tried in turn, from a worker picked per job, and a
+ * job that every worker turned down or could not be reached for is
+ * compiled locally.
+ *
+ * @param workers Comma-separated "host:port/slots" list, e.g.
+ *                "build1:3633/64,build2:3633/64" (16 slots if omitted).
+ * @return The executor; its callback is NULL if no worker was given.
+ */
+LINKAGE executor_t TCP_EXECUTOR(const char* workers);
+
+/**
+ * @brief Compiles jobs sent by TCP_EXECUTOR() clients.
+ *
+ * Each connection is served by a forked process. Past 'slots' connections
+ * at once, requests are answered as busy, so that clients compile them
+ * elsewhere. Only compilers are run (gcc, g++, cc, c++, clang and clang++,
+ * possibly prefixed or versioned, from PATH), with code generation and
+ * warning options only: paths, response files and options writing files,
+ * loading code or passing options to other tools are refused, and a
+ * connection idle for a minute is dropped. The port should still only be
+ * reachable from trusted machines.
+ *
+ * @param port  TCP port to listen on, e.g. "3633".
+ * @param slots Connections served at once; <= 0 selects the CPU count.
+ * @return Only returns, with a non-zero value, if serving fails.
+ */
+LINKAGE short SERVE_WORKER(const char* port, int slots);
+
+/**
+ * @brief Rebuilds and re-executes the build program if it is stale.
+ *
+ * Meant as the first statement of main(). The running binary is compared
+ * with the source file the macro appears in and with nobuild.h: when
+ * either is newer, the source is compiled again with NOB_REBUILD_CC
+ * (default "cc", or "c++" when compiled as C++) and NOB_REBUILD_FLAGS
+ * (default none; split on blanks, without quoting) into a temporary file
+ * that then replaces the binary, which is re-executed with the same
+ * arguments. Define both before including nobuild.h to match the command
+ * the program was first built with. Relative paths, as __FILE__ holds
+ * them, are taken from the binary's directory when the source is found
+ * there and from the working directory otherwise, and the compiler runs
+ * from that directory. When nothing changed this costs a few stat()
+ * calls. A failed compile exits with EXIT_FAILURE, leaving the old binary
+ * in place.
+ *
+ * @param __argc Argument count, as passed to main().
+ * @param __argv Argument vector, as passed to main().
+ */
+#define NOB_REBUILD_SELF(__argc, __argv) __rebuild_self((__argc), (__argv), __FILE__)
+
+#ifndef NOB_REBUILD_CC
+#ifdef __cplusplus
+#define NOB_REBUILD_CC "c++"
+#else
+#define NOB_REBUILD_CC "cc"
+#endif
+#endif
+
+#ifndef NOB_REBUILD_FLAGS
+#define NOB_REBUILD_FLAGS ""
+#endif
+
+LINKAGE void __rebuild_self(int argc, char** argv, const char* source);
+
 short __build(build_rule_t* rule);
 
 
 #ifdef NOB_IMPL
-#define DEFINE_ALLOC_FN(TYPE, __CAPACITY__)             \
-static TYPE* __##TYPE##_alloc(const TYPE copy) {        \
-    TYPE* allocated = (TYPE*) malloc(sizeof(TYPE));     \
-    if (!allocated) LIKELY {                            \
-        return NULL;                                    \
-    }                                                   \
-                                                        \
-    size_t len = strlen(copy.name);                     \
-    if (len > (__CAPACITY__) - 1) {                     \
-        free(allocated);                                \
-        return NULL;                                    \
-    }                                                   \
-    memcpy(allocated->name, copy.name, len);            \
-    allocated->name[len] = '\0';                        \
-    allocated->__next = NULL;                           \
-                                                        \
-    return allocated;                                   \
-}
-
-DEFINE_ALLOC_FN(flag_t, FLAG_CAPACITY)
-DEFINE_ALLOC_FN(object_t, OBJECT_CAPACITY)
+/************************************************************
+ * Hashing
+ ************************************************************/
 
+// XXH64 (https://github.com/Cyan4973/xxHash), byte-compatible with the
+// reference on little-endian machines.
+#define __XXH_P1 0x9E3779B185EBCA87ULL
+#define __XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define __XXH_P3 0x165667B19E3779F9ULL
+#define __XXH_P4 0x85EBCA77C2B2AE63ULL
+#define __XXH_P5 0x27D4EB2F165667C5ULL
 
-#define LIST_PUSH_BACK(TYPE, HEAD, OBJECT)              \
-do {                                                    \
-    TYPE* ptr = HEAD;                                   \
-    TYPE* prev = NULL;                                  \
-    for (; ptr != NULL; ptr = ptr->__next) LIKELY {     \
-        prev = ptr;                                     \
-    }                                                   \
-    if (!prev) UNLIKELY {                               \
-        HEAD = __##TYPE##_alloc(OBJECT);                \
-    } else LIKELY {                                     \
-        prev->__next = __##TYPE##_alloc(OBJECT);        \
-    }                                                   \
-} while(0);
+static inline uint64_t __rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
 
+static inline uint64_t __read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-void ADD_FLAG(flag_t **__flags, const flag_t __flag)
+static inline uint32_t __read32(const unsigned char* p)
 {
-    LIST_PUSH_BACK(flag_t, *__flags, __flag)
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-void ADD_OBJECT(object_t **__objects, const object_t __object)
+static inline uint64_t __xxh_round(uint64_t acc, uint64_t input)
 {
-    LIST_PUSH_BACK(object_t, *__objects, __object)
+    acc += input * __XXH_P2;
+    acc  = __rotl64(acc, 31);
+    return acc * __XXH_P1;
 }
 
-void MAKE_RULE(build_rule_t *__rule, compiler_t *__compiler, flag_t *__flags, object_t* __target, object_t* __dependencies, const char* output)
+static inline uint64_t __xxh_merge(uint64_t acc, uint64_t v)
 {
-    if (!__rule || !__compiler || !__dependencies) UNLIKELY {
-        return;
-    }
-    
-    LIKELY {
-        __rule->cc           = __compiler;
-        __rule->cc->flags    = __flags;
-        SET_OUT(__rule, output);
-        __rule->target       = __target;
-        __rule->dependencies = __dependencies;
-    }
+    acc ^= __xxh_round(0, v);
+    return acc * __XXH_P1 + __XXH_P4;
 }
 
-void cleanup(build_rule_t* rule)
+static uint64_t __hash64(const void* data, size_t len, uint64_t seed)
 {
-    if (!rule) {
-        return;
-    }
+    const unsigned char* p   = (const unsigned char*) data;
+    const unsigned char* end = p + len;
+    uint64_t h;
 
-    object_t* deps = rule->dependencies;
-    while (deps) {
-        object_t* next = deps->__next;
-        free(deps);
-        deps = next;
-    }
+    if (len >= 32) {
+        const unsigned char* limit = end - 32;
+        uint64_t v1 = seed + __XXH_P1 + __XXH_P2;
+        uint64_t v2 = seed + __XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - __XXH_P1;
 
-    flag_t* flags = rule->cc->flags;
-    while (flags) {
-        flag_t* next = flags->__next;
-        free(flags);
-        flags = next;
+        do {
+            v1 = __xxh_round(v1, __read64(p));      p += 8;
+            v2 = __xxh_round(v2, __read64(p));      p += 8;
+            v3 = __xxh_round(v3, __read64(p));      p += 8;
+            v4 = __xxh_round(v4, __read64(p));      p += 8;
+        } while (p <= limit);
+
+        h = __rotl64(v1, 1) + __rotl64(v2, 7) + __rotl64(v3, 12) + __rotl64(v4, 18);
+        h = __xxh_merge(h, v1);
+        h = __xxh_merge(h, v2);
+        h = __xxh_merge(h, v3);
+        h = __xxh_merge(h, v4);
+    } else {
+        h = seed + __XXH_P5;
     }
 
-    if (rule->cc) {
-        free(rule->cc);
+    h += (uint64_t) len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= __xxh_round(0, __read64(p));
+        h  = __rotl64(h, 27) * __XXH_P1 + __XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) __read32(p) * __XXH_P1;
+        h  = __rotl64(h, 23) * __XXH_P2 + __XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * __XXH_P5;
+        h  = __rotl64(h, 11) * __XXH_P1;
     }
 
-    free(rule);
+    h ^= h >> 33;
+    h *= __XXH_P2;
+    h ^= h >> 29;
+    h *= __XXH_P3;
+    h ^= h >> 32;
+    return h;
 }
 
-short BUILD(build_rule_t* rule)
+static inline uint64_t __hash_str(const char* str, uint64_t seed)
 {
-    if (!rule || !rule->cc || !rule->target || !rule->dependencies) {
-        return -1;
+    return __hash64(str, strlen(str), seed);
+}
+
+/**
+ * Hashes a NULL-terminated argv. Each argument seeds the next one, and the
+ * terminating NUL takes part so that {"ab", "c"} and {"a", "bc"} differ.
+ * Starting from the hash 'h' of a prefix gives the hash of the whole argv:
+ * __hash_argv_from(__hash_argv(a), b) == __hash_argv(a followed by b).
+ */
+static uint64_t __hash_argv_from(uint64_t h, char** argv)
+{
+    for (char** a = argv; *a; a++) LIKELY {
+        h = __hash64(*a, strlen(*a) + 1, h);
     }
+    return h;
+}
 
- #ifdef DEBUG
-    char command[1024] = {0};
+static inline uint64_t __hash_argv(char** argv)
+{
+    return __hash_argv_from(0, argv);
+}
 
-    // Start with the compiler command
-    snprintf(command, sizeof(command), "%s ", rule->cc->cmd);
 
-    // Add flags
-    for (flag_t* f = rule->cc->flags; f != NULL; f = f->__next) {
-        strncat(command, f->name, sizeof(command) - strlen(command) - 1);
-        strncat(command, " ", sizeof(command) - strlen(command) - 1);
-    }
 
-    // Add output
-    strncat(command, "-o ", sizeof(command) - strlen(command) - 1);
-    strncat(command, rule->output, sizeof(command) - strlen(command) - 1);
-    strncat(command, " ", sizeof(command) - strlen(command) - 1);
+/************************************************************
+ * Arena
+ ************************************************************/
 
-    // Add target
-    strncat(command, rule->target->name, sizeof(command) - strlen(command) - 1);
+/*
+ * Every list node (flag_t, object_t, rule_dep_t) and every name is carved
+ * out of one bump allocator made of large chunks (__nob_arena), so
+ * declaring thousands of sources costs a handful of malloc() calls, and
+ * cleanup() of the last live rule (__nob_rules counts those made and not
+ * cleaned up yet) frees them all at once. Names are interned: equal
+ * strings share the same storage, found through an open-addressing table
+ * of pointers (linear probing, power-of-two capacity, NULL marks a free
+ * slot).
+ * Each build carves its job command lines out of a second arena, __nob_run.
+ */
+#define __ARENA_CHUNK (64 * 1024)
+#define __ARENA_ALIGN 16
 
-    // Add dependencies
-    for (object_t* d = rule->dependencies; d != NULL; d = d->__next) {
-        strncat(command, d->name, sizeof(command) - strlen(command) - 1);
-        strncat(command, " ", sizeof(command) - strlen(command) - 1);
-    }
+typedef struct __arena_chunk {
+    struct __arena_chunk* __next;
+    size_t used, size;          /* Bytes of data, which follows the header. */
+} __arena_chunk_t;
 
-    printf("%s\n", command);
-#endif
+#define __ARENA_HEADER ((sizeof(__arena_chunk_t) + __ARENA_ALIGN - 1) & ~(size_t) (__ARENA_ALIGN - 1))
 
-    return __build(rule);
-}
+typedef struct __arena {
+    __arena_chunk_t* chunks;    /* Most recent chunk first. */
+    const char** strings;       /* Interned strings (hash table). */
+    size_t nstrings;
+    size_t capacity;            /* Power of two, or 0. */
+} __arena_t;
 
-short __build(build_rule_t* rule)
+static __arena_t __nob_arena = { NULL, NULL, 0, 0 };
+static __arena_t __nob_run   = { NULL, NULL, 0, 0 };
+static int __nob_rules = 0;
+
+static void* __arena_alloc(__arena_t* arena, size_t size)
 {
-    if (!rule || !rule->cc || !rule->target || !rule->dependencies) UNLIKELY {
-        return -1;
+    size = (size + __ARENA_ALIGN - 1) & ~(size_t) (__ARENA_ALIGN - 1);
+
+    __arena_chunk_t* chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        // Oversized requests get a chunk of their own, behind the current
+        // one, so that its free space is not thrown away.
+        const size_t capacity = (size > __ARENA_CHUNK / 4) ? size : __ARENA_CHUNK;
+        __arena_chunk_t* fresh = (__arena_chunk_t*) malloc(__ARENA_HEADER + capacity);
+        if (!fresh) UNLIKELY {
+            perror("malloc");
+            return NULL;
+        }
+        fresh->used = 0;
+        fresh->size = capacity;
+
+        if (chunk && capacity != __ARENA_CHUNK) {
+            fresh->__next = chunk->__next;
+            chunk->__next = fresh;
+        } else {
+            fresh->__next = chunk;
+            arena->chunks = fresh;
+        }
+        chunk = fresh;
     }
 
-    // First, count how many args we need
-    int argc = 0;
-    for (flag_t* f = rule->cc->flags; f; f = f->__next) LIKELY {
+    void* ptr = (char*) chunk + __ARENA_HEADER + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static short __intern_grow(void)
+{
+    size_t capacity = __nob_arena.capacity ? 2 * __nob_arena.capacity : 1024;
+    const char** strings = (const char**) calloc(capacity, sizeof(const char*));
+    if (!strings) UNLIKELY {
+        perror("calloc");
+        return -1;
+    }
+
+    for (size_t k = 0; k < __nob_arena.capacity; k++) {
+        const char* s = __nob_arena.strings[k];
+        if (s) {
+            size_t slot = __hash_str(s, 0) & (capacity - 1);
+            while (strings[slot]) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            strings[slot] = s;
+        }
+    }
+
+    free(__nob_arena.strings);
+    __nob_arena.strings  = strings;
+    __nob_arena.capacity = capacity;
+    return 0;
+}
+
+/**
+ * Returns the arena copy of 'str', shared with every equal string interned
+ * before the next __arena_release(), or NULL if out of memory.
+ */
+static const char* __intern(const char* str)
+{
+    if (2 * (__nob_arena.nstrings + 1) > __nob_arena.capacity && __intern_grow() != 0) UNLIKELY {
+        return NULL;
+    }
+
+    const size_t len = strlen(str);
+    size_t slot = __hash64(str, len, 0) & (__nob_arena.capacity - 1);
+    for (; __nob_arena.strings[slot]; slot = (slot + 1) & (__nob_arena.capacity - 1)) {
+        if (strcmp(__nob_arena.strings[slot], str) == 0) {
+            return __nob_arena.strings[slot];
+        }
+    }
+
+    char* copy = (char*) __arena_alloc(&__nob_arena, len + 1);
+    if (!copy) UNLIKELY {
+        return NULL;
+    }
+    memcpy(copy, str, len + 1);
+
+    __nob_arena.strings[slot] = copy;
+    __nob_arena.nstrings++;
+    return copy;
+}
+
+static void __arena_release(__arena_t* arena)
+{
+    __arena_chunk_t* chunk = arena->chunks;
+    while (chunk) {
+        __arena_chunk_t* next = chunk->__next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->strings);
+    memset(arena, 0, sizeof(*arena));
+}
+
+
+
+/************************************************************
+ * Lists
+ ************************************************************/
+
+#define DEFINE_ALLOC_FN(TYPE)                                   \
+static TYPE* __##TYPE##_alloc(const TYPE copy) {                \
+    if (!copy.name) UNLIKELY {                                  \
+        return NULL;                                            \
+    }                                                           \
+                                                                \
+    TYPE* allocated =                                           \
+        (TYPE*) __arena_alloc(&__nob_arena, sizeof(TYPE));      \
+    if (!allocated) UNLIKELY {                                  \
+        return NULL;                                            \
+    }                                                           \
+                                                                \
+    allocated->name = __intern(copy.name);                      \
+    if (!allocated->name) UNLIKELY {                            \
+        return NULL;                                            \
+    }                                                           \
+    allocated->__next  = NULL;                                  \
+    allocated->__tail  = NULL;                                  \
+    allocated->__count = 0;                                     \
+                                                                \
+    return allocated;                                           \
+}
+
+DEFINE_ALLOC_FN(flag_t)
+DEFINE_ALLOC_FN(object_t)
+
+
+/*
+ * The head of a list keeps a pointer to its last node and the list length,
+ * so appending is O(1) and the planner never walks a list just to size it.
+ * Lists linked by hand (head without a count) fall back to a walk.
+ */
+#define LIST_PUSH_BACK(TYPE, HEAD, OBJECT)              \
+do {                                                    \
+    TYPE* node = __##TYPE##_alloc(OBJECT);              \
+    if (!node) UNLIKELY {                               \
+        break;                                          \
+    }                                                   \
+    if (!(HEAD)) UNLIKELY {                             \
+        (HEAD) = node;                                  \
+    } else LIKELY {                                     \
+        TYPE* last = (HEAD)->__tail;                    \
+        if (!(HEAD)->__count) UNLIKELY {                \
+            (HEAD)->__count = __##TYPE##_count(HEAD);   \
+            last = (HEAD);                              \
+            while (last->__next) {                      \
+                last = last->__next;                    \
+            }                                           \
+        }                                               \
+        last->__next = node;                            \
+    }                                                   \
+    (HEAD)->__tail = node;                              \
+    (HEAD)->__count++;                                  \
+} while(0);
+
+#define DEFINE_COUNT_FN(TYPE)                           \
+static int __##TYPE##_count(const TYPE* head) {         \
+    if (!head) {                                        \
+        return 0;                                       \
+    }                                                   \
+    if (head->__count) LIKELY {                         \
+        return head->__count;                           \
+    }                                                   \
+    int n = 0;                                          \
+    for (; head; head = head->__next) {                 \
+        n++;                                            \
+    }                                                   \
+    return n;                                           \
+}
+
+DEFINE_COUNT_FN(flag_t)
+DEFINE_COUNT_FN(object_t)
+
+
+
+/************************************************************
+ * Flag Sets
+ ************************************************************/
+
+/*
+ * MAKE_RULE() turns the compiler and its flag list into an interned,
+ * immutable flag set: the argv prefix `cc <flags>` every job of the rule
+ * starts with, plus its hash. Rules with equal prefixes share one set, so
+ * a job's argv is a memcpy() of the prefix followed by its own tail, and
+ * the command hash of a job only has to cover that tail. A set owns a
+ * copy of its strings and is freed when its last rule is cleaned up.
+ */
+typedef struct __flag_set {
+    int __refs;                 /* Rules pointing at the set. */
+    int argc;                   /* Entries of 'argv' (compiler + flags). */
+    char** argv;                /* Prefix, stored right after the header. */
+    uint64_t hash;              /* __hash_argv() of the prefix. */
+    struct __flag_set* __next;  /* Next interned set. */
+} __flag_set_t;
+
+static __flag_set_t* __nob_flag_sets = NULL;
+
+static int __flag_set_equals(const __flag_set_t* set, const char* cmd, const flag_t* flags, int nflags)
+{
+    if (set->argc != 1 + nflags || strcmp(set->argv[0], cmd) != 0) {
+        return 0;
+    }
+    for (int k = 1; k < set->argc; k++, flags = flags->__next) {
+        if (strcmp(set->argv[k], flags->name) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns a new reference to the set holding `cmd <flags>`, creating it if
+ * no rule uses that prefix yet, or NULL if out of memory.
+ */
+static __flag_set_t* __flag_set_intern(const char* cmd, const flag_t* flags)
+{
+    const int nflags = __flag_t_count(flags);
+
+    uint64_t hash = __hash64(cmd, strlen(cmd) + 1, 0);
+    size_t bytes  = strlen(cmd) + 1;
+    for (const flag_t* f = flags; f; f = f->__next) LIKELY {
+        hash   = __hash64(f->name, strlen(f->name) + 1, hash);
+        bytes += strlen(f->name) + 1;
+    }
+
+    for (__flag_set_t* set = __nob_flag_sets; set; set = set->__next) {
+        if (set->hash == hash && __flag_set_equals(set, cmd, flags, nflags)) {
+            set->__refs++;
+            return set;
+        }
+    }
+
+    const size_t strings = sizeof(__flag_set_t) + (2 + nflags) * sizeof(char*);
+    __flag_set_t* set = (__flag_set_t*) malloc(strings + bytes);
+    if (!set) UNLIKELY {
+        perror("malloc");
+        return NULL;
+    }
+
+    set->__refs = 1;
+    set->argc   = 1 + nflags;
+    set->argv   = (char**) (set + 1);
+    set->hash   = hash;
+
+    char* p = (char*) set + strings;
+    const flag_t* f = flags;
+    for (int k = 0; k < set->argc; k++) LIKELY {
+        const char* s = (k == 0) ? cmd : f->name;
+        const size_t len = strlen(s) + 1;
+        memcpy(p, s, len);
+        set->argv[k] = p;
+        p += len;
+        if (k > 0) {
+            f = f->__next;
+        }
+    }
+    set->argv[set->argc] = NULL;
+
+    set->__next = __nob_flag_sets;
+    __nob_flag_sets = set;
+    return set;
+}
+
+static void __flag_set_release(__flag_set_t* set)
+{
+    if (!set || --set->__refs > 0) {
+        return;
+    }
+
+    __flag_set_t** link = &__nob_flag_sets;
+    while (*link != set) {
+        link = &(*link)->__next;
+    }
+    *link = set->__next;
+    free(set);
+}
+
+
+
+/************************************************************
+ * API Functions
+ ************************************************************/
+
+void ADD_FLAG(flag_t **__flags, const flag_t __flag)
+{
+    LIST_PUSH_BACK(flag_t, *__flags, __flag)
+}
+
+void ADD_OBJECT(object_t **__objects, const object_t __object)
+{
+    LIST_PUSH_BACK(object_t, *__objects, __object)
+}
+
+void MAKE_RULE(build_rule_t *__rule, compiler_t *__compiler, flag_t *__flags, object_t* __target, object_t* __dependencies, const char* output)
+{
+    if (!__rule || !__compiler || !__dependencies) UNLIKELY {
+        return;
+    }
+    
+    __flag_set_t* set = __flag_set_intern(__compiler->cmd, __flags);
+    if (!set) UNLIKELY {
+        return;
+    }
+
+    LIKELY {
+        __nob_rules += (__rule->__flags == NULL);
+        __flag_set_release(__rule->__flags);
+        if (__rule->cc != __compiler) {
+            __compiler->__refs++;
+        }
+        __rule->cc           = __compiler;
+        __rule->__flags      = set;
+        SET_OUT(__rule, output);
+        __rule->target       = __target;
+        __rule->dependencies = __dependencies;
+    }
+}
+
+void MAKE_PCH(build_rule_t *__rule, compiler_t *__compiler, flag_t *__flags, object_t* __header, const char* output)
+{
+    if (!__rule || !__compiler || !__header) UNLIKELY {
+        return;
+    }
+
+    __flag_set_t* set = __flag_set_intern(__compiler->cmd, __flags);
+    if (!set) UNLIKELY {
+        return;
+    }
+
+    __nob_rules += (__rule->__flags == NULL);
+    __flag_set_release(__rule->__flags);
+    if (__rule->cc != __compiler) {
+        __compiler->__refs++;
+    }
+    __rule->cc           = __compiler;
+    __rule->__flags      = set;
+    __rule->target       = __header;
+    __rule->dependencies = NULL;
+    __rule->mode         = BUILD_MODE_PCH;
+    snprintf(__rule->output, sizeof(__rule->output), "%s", output);
+}
+
+void USE_PCH(build_rule_t *__rule, build_rule_t *__pch)
+{
+    if (!__rule || !__pch || __pch == __rule) UNLIKELY {
+        return;
+    }
+    __rule->pch = __pch;
+}
+
+void DEPENDS_ON(build_rule_t *__rule, build_rule_t *__dependency)
+{
+    if (!__rule || !__dependency) UNLIKELY {
+        return;
+    }
+
+    rule_dep_t* dep = (rule_dep_t*) __arena_alloc(&__nob_arena, sizeof(rule_dep_t));
+    if (!dep) UNLIKELY {
+        return;
+    }
+    dep->rule   = __dependency;
+    dep->__next = NULL;
+
+    rule_dep_t** tail = &__rule->upstream;
+    while (*tail) LIKELY {
+        tail = &(*tail)->__next;
+    }
+    *tail = dep;
+}
+
+void cleanup(build_rule_t* rule)
+{
+    if (!rule) {
+        return;
+    }
+
+    // Lists and names of every rule live in the arena.
+    __nob_rules -= (rule->__flags != NULL && __nob_rules > 0);
+    if (__nob_rules == 0) {
+        __arena_release(&__nob_arena);
+    }
+
+    __flag_set_release(rule->__flags);
+    if (rule->cc && --rule->cc->__refs <= 0) {
+        free(rule->cc);
+    }
+
+    free(rule);
+}
+
+short BUILD(build_rule_t* rule)
+{
+    if (!rule || !rule->cc || !rule->target || (!rule->dependencies && rule->mode != BUILD_MODE_PCH)) {
+        return -1;
+    }
+
+    return __build(rule);
+}
+
+
+
+/************************************************************
+ * Build Database
+ ************************************************************/
+
+/*
+ * The build database remembers, for every output, the command that built
+ * it and how long that took and, for every file whose contents were hashed,
+ * the size and mtime the hash belongs to. On disk it is the in-memory image itself: a
+ * header followed by an open-addressing hash table of fixed-size records
+ * (linear probing, power-of-two capacity, key 0 marks a free slot). It is
+ * loaded with a single MAP_PRIVATE mmap, so there is no parsing at all and
+ * updates go to private copy-on-write pages until the table is written back
+ * (to a temporary file, then renamed over the old one).
+ */
+#define __DB_MAGIC   0x31424442424F4EULL    /* "NOBBDB1" */
+#define __DB_VERSION 3
+#define __DB_DEFAULT ".nobuild_db"
+
+#define __DB_HASHED  (1u << 0)    /* 'content_hash' matches 'size' and 'mtime_ns'. */
+
+typedef struct __db_record {
+    uint64_t key;           /* Hash of the path, 0 if the slot is free. */
+    uint64_t cmd_hash;      /* Output: hash of the full argv that produced it. */
+    uint64_t in_hash;       /* Output: hash of its inputs' paths and contents (CHECK_HASH). */
+    uint64_t content_hash;  /* File: hash of its contents, valid if __DB_HASHED. */
+    int64_t  mtime_ns;      /* File: mtime when last seen. */
+    int64_t  size;          /* File: size when last seen. */
+    uint32_t duration_us;   /* Output: wall time of the job. */
+    uint32_t flags;         /* __DB_* bits. */
+    uint32_t max_rss_kb;    /* Output: peak resident set size of the job. */
+    uint32_t __pad;
+} __db_record_t;
+
+typedef struct __db_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t capacity;      /* Number of slots, a power of two. */
+    uint32_t count;         /* Number of used slots. */
+    uint32_t __pad;
+} __db_header_t;
+
+static struct __db {
+    __db_header_t* table;   /* Header, immediately followed by the records. */
+    size_t size;            /* Bytes mapped or allocated at 'table'. */
+    int mapped;             /* 'table' comes from mmap() rather than malloc(). */
+    int dirty;              /* Something changed since the last __db_save(). */
+    int opened;
+    int disabled;
+    char path[OUT_CAPACITY];
+} __nob_db;
+
+void SET_DB(const char* path)
+{
+    __nob_db.disabled = (path == NULL || path[0] == '\0');
+    if (!__nob_db.disabled) {
+        strncpy(__nob_db.path, path, OUT_CAPACITY - 1);
+    }
+}
+
+static inline __db_record_t* __db_records(__db_header_t* table)
+{
+    return (__db_record_t*) (table + 1);
+}
+
+static inline uint64_t __db_key(const char* path)
+{
+    uint64_t key = __hash_str(path, 0);
+    return key ? key : 1;
+}
+
+static short __db_alloc(uint32_t capacity)
+{
+    size_t size = sizeof(__db_header_t) + (size_t) capacity * sizeof(__db_record_t);
+    __db_header_t* table = (__db_header_t*) calloc(1, size);
+    if (!table) UNLIKELY {
+        perror("calloc");
+        return -1;
+    }
+
+    table->magic    = __DB_MAGIC;
+    table->version  = __DB_VERSION;
+    table->capacity = capacity;
+
+    __nob_db.table  = table;
+    __nob_db.size   = size;
+    __nob_db.mapped = 0;
+    return 0;
+}
+
+/**
+ * Maps the database file, or starts from an empty table if it is missing,
+ * truncated or written by an incompatible version.
+ */
+static void __db_open(void)
+{
+    if (__nob_db.opened || __nob_db.disabled) {
+        return;
+    }
+    __nob_db.opened = 1;
+
+    if (!__nob_db.path[0]) {
+        const char* env = getenv("NOB_DB");
+        if (env && !env[0]) {
+            __nob_db.disabled = 1;
+            return;
+        }
+        strncpy(__nob_db.path, env ? env : __DB_DEFAULT, OUT_CAPACITY - 1);
+    }
+
+    int fd = open(__nob_db.path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(__db_header_t)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            __db_header_t* table = (__db_header_t*) map;
+            size_t expected = sizeof(__db_header_t) + (size_t) table->capacity * sizeof(__db_record_t);
+
+            if (table->magic == __DB_MAGIC && table->version == __DB_VERSION &&
+                table->capacity && !(table->capacity & (table->capacity - 1)) &&
+                expected == (size_t) st.st_size) LIKELY {
+                __nob_db.table  = table;
+                __nob_db.size   = st.st_size;
+                __nob_db.mapped = 1;
+            } else {
+                munmap(map, st.st_size);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (!__nob_db.table && __db_alloc(1024) != 0) UNLIKELY {
+        __nob_db.disabled = 1;
+    }
+}
+
+static __db_record_t* __db_find(uint64_t key)
+{
+    if (!__nob_db.table) {
+        return NULL;
+    }
+
+    __db_record_t* records = __db_records(__nob_db.table);
+    uint32_t mask = __nob_db.table->capacity - 1;
+    for (uint32_t i = (uint32_t) key & mask; records[i].key; i = (i + 1) & mask) LIKELY {
+        if (records[i].key == key) {
+            return &records[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the record for 'key', inserting an empty one if needed. The table
+ * is doubled once it would become more than 3/4 full.
+ */
+static __db_record_t* __db_upsert(uint64_t key)
+{
+    __db_record_t* found = __db_find(key);
+    if (found || !__nob_db.table) {
+        return found;
+    }
+
+    if (4 * (__nob_db.table->count + 1) > 3 * __nob_db.table->capacity) UNLIKELY {
+        __db_header_t* old = __nob_db.table;
+        size_t old_size    = __nob_db.size;
+        int old_mapped     = __nob_db.mapped;
+
+        if (__db_alloc(2 * old->capacity) != 0) {
+            __nob_db.table  = old;
+            __nob_db.size   = old_size;
+            __nob_db.mapped = old_mapped;
+            return NULL;
+        }
+
+        __db_record_t* records = __db_records(__nob_db.table);
+        uint32_t mask = __nob_db.table->capacity - 1;
+        for (uint32_t k = 0; k < old->capacity; k++) {
+            const __db_record_t* r = &__db_records(old)[k];
+            if (!r->key) {
+                continue;
+            }
+
+            uint32_t i = (uint32_t) r->key & mask;
+            while (records[i].key) {
+                i = (i + 1) & mask;
+            }
+            records[i] = *r;
+            __nob_db.table->count++;
+        }
+
+        if (old_mapped) {
+            munmap(old, old_size);
+        } else {
+            free(old);
+        }
+    }
+
+    __db_record_t* records = __db_records(__nob_db.table);
+    uint32_t mask = __nob_db.table->capacity - 1;
+    uint32_t i = (uint32_t) key & mask;
+    while (records[i].key) {
+        i = (i + 1) & mask;
+    }
+
+    memset(&records[i], 0, sizeof(__db_record_t));
+    records[i].key = key;
+    __nob_db.table->count++;
+    return &records[i];
+}
+
+/**
+ * Writes the table back with a single write() to a temporary file which is
+ * then renamed over the database, so readers never see a partial file.
+ */
+static void __db_save(void)
+{
+    if (!__nob_db.table || !__nob_db.dirty) {
+        return;
+    }
+
+    char tmp[OUT_CAPACITY + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", __nob_db.path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) UNLIKELY {
+        perror("open");
+        return;
+    }
+
+    const char* p = (const char*) __nob_db.table;
+    size_t left = __nob_db.size;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) UNLIKELY {
+            perror("write");
+            close(fd);
+            unlink(tmp);
+            return;
+        }
+        p    += n;
+        left -= n;
+    }
+
+    if (close(fd) != 0 || rename(tmp, __nob_db.path) != 0) UNLIKELY {
+        perror("rename");
+        unlink(tmp);
+        return;
+    }
+    __nob_db.dirty = 0;
+}
+
+static inline long long __now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+/************************************************************
+ * Depfiles
+ ************************************************************/
+
+/*
+ * Implicit dependencies of a job, as listed by the Make-style depfile the
+ * compiler writes with -MMD -MF. All paths live back to back in a single
+ * buffer, each one NUL-terminated.
+ */
+typedef struct __depfile {
+    char* paths;
+    int count;
+} __depfile_t;
+
+static void __depfile_free(__depfile_t* dep)
+{
+    free(dep->paths);
+    dep->paths = NULL;
+    dep->count = 0;
+}
+
+/**
+ * Parses a depfile such as
+ *
+ *     test/foo.o: test/foo.c test/foo.h \
+ *       test/dir\ with\ spaces/bar.h
+ *
+ * keeping only the prerequisites. Handles line continuations and the
+ * escapes gcc/clang emit ('\ ', '\#' and '$$'); every token ending in ':'
+ * is a target and drops the tokens seen before it on the same line.
+ * Returns 0 on success, -1 if the file cannot be read.
+ */
+static short __depfile_load(const char* path, __depfile_t* dep)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+
+    long size = (fseek(f, 0, SEEK_END) == 0) ? ftell(f) : -1;
+    rewind(f);
+
+    char* in  = (size >= 0) ? (char*) malloc(size + 1) : NULL;
+    char* out = (size >= 0) ? (char*) malloc(size + 1) : NULL;
+    if (!in || !out || fread(in, 1, size, f) != (size_t) size) UNLIKELY {
+        fclose(f);
+        free(in);
+        free(out);
+        return -1;
+    }
+    fclose(f);
+
+    const char* r   = in;
+    const char* end = in + size;
+    char* w = out;
+    char* line = out;       // First token of the current logical line
+    int count = 0, line_count = 0;
+
+    while (r < end) {
+        if (*r == '\\' && r + 1 < end && (r[1] == '\n' || r[1] == '\r')) {
+            r += (r[1] == '\r' && r + 2 < end && r[2] == '\n') ? 3 : 2;
+            continue;
+        }
+        if (*r == '\n') {
+            line = w;
+            line_count = count;
+            r++;
+            continue;
+        }
+        if (*r == ' ' || *r == '\t' || *r == '\r') {
+            r++;
+            continue;
+        }
+
+        char* token = w;
+        while (r < end && *r != ' ' && *r != '\t' && *r != '\n' && *r != '\r') LIKELY {
+            if (*r == '\\' && r + 1 < end && (r[1] == ' ' || r[1] == '#')) {
+                *w++ = r[1];
+                r += 2;
+            } else if (*r == '\\' && r + 1 < end && (r[1] == '\n' || r[1] == '\r')) {
+                break;
+            } else if (*r == '$' && r + 1 < end && r[1] == '$') {
+                *w++ = '$';
+                r += 2;
+            } else {
+                *w++ = *r++;
+            }
+        }
+
+        if (w > token && w[-1] == ':') {
+            // Targets: forget them and whatever preceded them on this line.
+            w = line;
+            count = line_count;
+            continue;
+        }
+
+        *w++ = '\0';
+        count++;
+    }
+    free(in);
+
+    char* paths = (char*) realloc(out, (w > out) ? (size_t) (w - out) : 1);
+    dep->paths = paths ? paths : out;
+    dep->count = count;
+    return 0;
+}
+
+
+
+/************************************************************
+ * Job Pool
+ ************************************************************/
+
+/*
+ * A job is one child process (a compile or a link). Jobs form a DAG: a
+ * job becomes ready once all of its prerequisites ('__pending') finished,
+ * and '__succ' lists the jobs waiting on it.
+ */
+typedef struct __job {
+    char** argv;                /* NULL-terminated command line. */
+    int argc;                   /* Entries in 'argv', NULL excluded. */
+    uint64_t cmd_hash;          /* __hash_argv(argv) without the last '__sized' entries. */
+    char output[OUT_CAPACITY];  /* File produced by the job. */
+    char** inputs;              /* Files the output is built from. */
+    int ninputs;
+    char depfile[OUT_CAPACITY]; /* Compiler-written depfile, empty if none. */
+    __depfile_t deps;           /* Implicit inputs parsed from 'depfile'. */
+    struct __job** __succ;      /* Jobs that depend on this one. */
+    int __nsucc;
+    int __capsucc;              /* Room in '__succ'. */
+    int __pending;              /* Number of unfinished prerequisites. */
+    pid_t __pid;                /* Child pid while running, 0 otherwise. */
+    long long __start;          /* __now_us() at spawn time. */
+    int __checked;              /* Up-to-date and direct cache checks done. */
+    int __fetched;              /* A remote fetch already missed. */
+    const struct __flag_set* __prefix; /* Flag set 'argv' starts with. */
+    int __rsp;                  /* Running from '<output>.rsp'. */
+    long long __bytes;          /* Size of the main input. */
+    int __clean;                /* Remove 'output' before running (archives). */
+    int __slots;                /* Job slots taken up while running (multi-threaded links). */
+    int __sized;                /* Trailing argv entries sized to the job slots (see __link_jobs()). */
+    int __done;                 /* Finished successfully; kept across WATCH() rebuilds. */
+    int __offload;              /* May run on the executor (compiles without a PCH). */
+    int __offloaded;            /* Running on the executor. */
+    int __declined;             /* Turned down by the executor, waits for a local slot. */
+    char* __toc;                /* Interface file of a shared library, NULL if none. */
+    long long __priority;       /* Expected microseconds to the end of the build. */
+    long long __rss;            /* Expected peak memory use, in bytes. */
+    long __maxrss_kb;           /* Peak RSS reported by wait4(). */
+    long long __ready;          /* __now_us() when it first became ready, if tracing. */
+    int __pidfd;                /* Pidfd of the running child, -1 if none. */
+    int __out_fd;               /* Read end of the child's output pipe, -1 if none. */
+    char* __log;                /* Output collected so far. */
+    size_t __nlog, __caplog;
+} __job_t;
+
+static int __nob_jobs = 0;
+
+void SET_JOBS(int jobs)
+{
+    __nob_jobs = (jobs > 0) ? jobs : 0;
+}
+
+static int __jobs_limit(void)
+{
+    if (__nob_jobs > 0) {
+        return __nob_jobs;
+    }
+
+    const char* env = getenv("NOB_JOBS");
+    if (env) {
+        long n = strtol(env, NULL, 10);
+        if (n > 0) {
+            return (int) n;
+        }
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int) n : 1;
+}
+
+/**
+ * Parses a size in bytes with an optional K/M/G suffix, e.g. "512M".
+ */
+static long long __parse_size(const char* str)
+{
+    char* unit = NULL;
+    long long size = strtoll(str, &unit, 10);
+    switch (unit ? *unit : '\0') {
+        case 'G': case 'g': size <<= 30; break;
+        case 'M': case 'm': size <<= 20; break;
+        case 'K': case 'k': size <<= 10; break;
+        default: break;
+    }
+    return size;
+}
+
+/**
+ * Records that 'after' cannot start before 'before' has finished.
+ */
+static short __job_then(__job_t* before, __job_t* after)
+{
+    // Successor lists live in the run arena and double when full: most
+    // jobs (compiles) have exactly one, the link.
+    if (before->__nsucc == before->__capsucc) {
+        const int capacity = before->__capsucc ? 2 * before->__capsucc : 1;
+        __job_t** succ = (__job_t**) __arena_alloc(&__nob_run, capacity * sizeof(__job_t*));
+        if (!succ) UNLIKELY {
+            return -1;
+        }
+        if (before->__nsucc > 0) {
+            memcpy(succ, before->__succ, before->__nsucc * sizeof(__job_t*));
+        }
+        before->__succ    = succ;
+        before->__capsucc = capacity;
+    }
+
+    before->__succ[before->__nsucc++] = after;
+    after->__pending++;
+    return 0;
+}
+
+static void __jobs_free(__job_t* jobs, int njobs)
+{
+    for (int j = 0; j < njobs; j++) {
+        __depfile_free(&jobs[j].deps);
+        free(jobs[j].__log);
+    }
+    free(jobs);
+    __arena_release(&__nob_run); // argv, inputs and successor lists
+}
+
+// POSIX.1-2008 exposes nanosecond timestamps as 'st_mtim' (glibc then
+// defines 'st_mtime' as a macro on top of it); Apple calls it 'st_mtimespec'.
+#if defined(__APPLE__)
+#define __MTIME_NS(__ST__) ((long long) (__ST__).st_mtimespec.tv_sec * 1000000000LL + (__ST__).st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define __MTIME_NS(__ST__) ((long long) (__ST__).st_mtim.tv_sec * 1000000000LL + (__ST__).st_mtim.tv_nsec)
+#else
+#define __MTIME_NS(__ST__) ((long long) (__ST__).st_mtime * 1000000000LL)
+#endif
+
+static check_mode_t __nob_check = CHECK_MTIME;
+static int __nob_check_set = 0;
+
+void SET_CHECK(check_mode_t mode)
+{
+    __nob_check = mode;
+    __nob_check_set = 1;
+}
+
+/**
+ * Hashes the contents of a file, reusing the hash memoized in the build
+ * database while the file keeps the size and mtime it had back then. The
+ * file is read through mmap() to avoid copying it.
+ * Returns 0 on success, -1 if the file cannot be read.
+ */
+static short __file_hash(const char* path, uint64_t* hash)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+
+    const uint64_t key = __db_key(path);
+    const __db_record_t* memo = __db_find(key);
+    if (memo && (memo->flags & __DB_HASHED) && memo->size == (int64_t) st.st_size &&
+        memo->mtime_ns == __MTIME_NS(st)) LIKELY {
+        *hash = memo->content_hash;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) UNLIKELY {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) UNLIKELY {
+            close(fd);
+            return -1;
+        }
+        *hash = __hash64(map, st.st_size, 0);
+        munmap(map, st.st_size);
+    } else {
+        *hash = __hash64(NULL, 0, 0);
+    }
+    close(fd);
+
+    __db_record_t* record = __db_upsert(key);
+    if (record) LIKELY {
+        record->content_hash = *hash;
+        record->size         = (int64_t) st.st_size;
+        record->mtime_ns     = __MTIME_NS(st);
+        record->flags       |= __DB_HASHED;
+        __nob_db.dirty = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Combines the paths and content hashes of every input of a job, explicit
+ * ones first, then those listed in its (already loaded) depfile.
+ */
+static short __job_inputs_hash(const __job_t* job, uint64_t* in_hash)
+{
+    uint64_t h = 0, content = 0;
+
+    for (int k = 0; k < job->ninputs; k++) LIKELY {
+        if (__file_hash(job->inputs[k], &content) != 0) {
+            return -1;
+        }
+        h = __hash_str(job->inputs[k], h);
+        h = __hash64(&content, sizeof(content), h);
+    }
+
+    const char* p = job->deps.paths;
+    for (int k = 0; k < job->deps.count; k++, p += strlen(p) + 1) LIKELY {
+        if (__file_hash(p, &content) != 0) {
+            return -1;
+        }
+        h = __hash_str(p, h);
+        h = __hash64(&content, sizeof(content), h);
+    }
+
+    *in_hash = h;
+    return 0;
+}
+
+/**
+ * A job is up to date when its output exists and is strictly newer than
+ * every one of its inputs, including the headers listed in its depfile,
+ * and the build database shows it was produced by the same command line.
+ * Missing inputs always make the job stale, so that the compiler gets to
+ * report them; so does a missing depfile, since the headers are unknown,
+ * and so does a missing database record.
+ */
+static int __job_uptodate(__job_t* job)
+{
+    struct stat st;
+    if (stat(job->output, &st) != 0) {
+        return 0;
+    }
+    const long long out = __MTIME_NS(st);
+
+    for (int k = 0; k < job->ninputs; k++) LIKELY {
+        if (stat(job->inputs[k], &st) != 0 || __MTIME_NS(st) >= out) {
+            return 0;
+        }
+    }
+
+    if (job->depfile[0]) {
+        __depfile_free(&job->deps);
+        if (__depfile_load(job->depfile, &job->deps) != 0) {
+            return 0;
+        }
+
+        const char* p = job->deps.paths;
+        for (int k = 0; k < job->deps.count; k++, p += strlen(p) + 1) LIKELY {
+            if (stat(p, &st) != 0 || __MTIME_NS(st) >= out) {
+                return 0;
+            }
+        }
+    }
+
+    if (__nob_db.table) {
+        const __db_record_t* record = __db_find(__db_key(job->output));
+        if (!record || record->cmd_hash != job->cmd_hash) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * CHECK_HASH flavour of __job_uptodate(): the output must exist and its
+ * record must match both the command line and the current input hash.
+ */
+static int __job_uptodate_hash(__job_t* job)
+{
+    struct stat st;
+    if (stat(job->output, &st) != 0) {
+        return 0;
+    }
+
+    const __db_record_t* record = __db_find(__db_key(job->output));
+    if (!record || record->cmd_hash != job->cmd_hash) {
+        return 0;
+    }
+
+    if (job->depfile[0]) {
+        __depfile_free(&job->deps);
+        if (__depfile_load(job->depfile, &job->deps) != 0) {
+            return 0;
+        }
+    }
+
+    // Hashing may grow the table, so the record is looked up again after.
+    uint64_t in_hash = 0;
+    if (__job_inputs_hash(job, &in_hash) != 0) {
+        return 0;
+    }
+
+    record = __db_find(__db_key(job->output));
+    return record && record->in_hash == in_hash;
+}
+
+/**
+ * Stores the command line, output state, duration and peak memory use of
+ * a job that just succeeded into the build database. In CHECK_HASH mode the
+ * inputs are hashed again, with the depfile the compiler just wrote. The
+ * duration and peak are left alone unless 'timed' (a cache hit says
+ * nothing about the compiler's).
+ */
+static void __job_record(__job_t* job, int timed)
+{
+    long long elapsed = __now_us() - job->__start;
+
+    uint64_t in_hash = 0;
+    if (__nob_check == CHECK_HASH) {
+        if (job->depfile[0]) {
+            __depfile_free(&job->deps);
+            __depfile_load(job->depfile, &job->deps);
+        }
+        __job_inputs_hash(job, &in_hash);
+    }
+
+    __db_record_t* record = __db_upsert(__db_key(job->output));
+    if (!record) {
+        return;
+    }
+
+    struct stat st;
+    int found = (stat(job->output, &st) == 0);
+
+    record->cmd_hash    = job->cmd_hash;
+    record->in_hash     = in_hash;
+    record->mtime_ns    = found ? __MTIME_NS(st) : 0;
+    record->size        = found ? (int64_t) st.st_size : -1;
+    if (timed) {
+        record->duration_us = (elapsed > (long long) UINT32_MAX) ? UINT32_MAX : (uint32_t) elapsed;
+        if (job->__maxrss_kb > 0) {
+            record->max_rss_kb = (job->__maxrss_kb > (long) UINT32_MAX) ? UINT32_MAX : (uint32_t) job->__maxrss_kb;
+        }
+    }
+    record->flags      &= ~__DB_HASHED;
+    __nob_db.dirty = 1;
+}
+
+/*
+ * Children are created with posix_spawnp(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK): unlike fork(), its cost does not grow with
+ * the page tables of a scheduler holding a large graph, build database and
+ * mmap'ed inputs. Define NOB_USE_FORK to go back to fork() + execvp().
+ */
+extern char** environ;
+
+/**
+ * Executes a NULL-terminated argv in a new process. If 'out' is a valid
+ * descriptor, the child's stdout and stderr are redirected to it.
+ * Returns the child pid, or -1 if the process could not be created.
+ */
+static pid_t __spawn(char** argv, int out)
+{
+#ifdef DEBUG
+    for (char** a = argv; *a; a++) {
+        printf("%s%s", *a, a[1] ? " " : "\n");
+    }
+    fflush(stdout);
+#endif
+
+#ifdef NOB_USE_FORK
+    // Fork process
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child process
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+            dup2(out, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        perror("execvp"); // Only if execvp fails
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+#else
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t* pactions = NULL;
+
+    if (out >= 0) {
+        if (posix_spawn_file_actions_init(&actions) != 0) UNLIKELY {
+            perror("posix_spawn_file_actions_init");
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out, STDERR_FILENO);
+        pactions = &actions;
+    }
+
+    pid_t pid = -1;
+    int error = posix_spawnp(&pid, argv[0], pactions, NULL, argv, environ);
+
+    if (pactions) {
+        posix_spawn_file_actions_destroy(pactions);
+    }
+
+    if (error != 0) {
+        errno = error;
+        perror("posix_spawnp");
+        return -1;
+    }
+
+    return pid;
+#endif  // NOB_USE_FORK
+}
+
+static short __write_all(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes 'size' bytes to 'path' unless the file already holds exactly
+ * them, so that unchanged generated files (unity batches, interface
+ * files) keep their mtime.
+ */
+static short __write_if_changed(const char* path, const char* data, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        int same = (fstat(fd, &st) == 0 && (size_t) st.st_size == size);
+        if (same && size > 0) {
+            void* old = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            same = (old != MAP_FAILED && memcmp(old, data, size) == 0);
+            if (old != MAP_FAILED) {
+                munmap(old, size);
+            }
+        }
+        close(fd);
+        if (same) {
+            return 0;
+        }
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    short result = (fd >= 0 && __write_all(fd, data, size) == 0) ? 0 : -1;
+    if (fd >= 0 && close(fd) != 0) {
+        result = -1;
+    }
+    if (result != 0) UNLIKELY {
+        perror(path);
+    }
+    return result;
+}
+
+/*
+ * Interface files. A shared library's '<output>.toc' holds a hash of its
+ * interface as the static linker sees it: the name, type and binding of
+ * every symbol its dynamic symbol table defines and exports, plus the size
+ * of data objects (copy relocations depend on it). Rules consuming the
+ * library depend on the .toc rather than on the library, and the .toc is
+ * only rewritten when the hash changed, so relinking a library without
+ * changing its interface does not relink everything above it. Files that
+ * are not 64-bit ELF are hashed whole.
+ */
+static int __abi_cmp(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static short __abi_hash(const char* path, uint64_t* hash)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    const unsigned char* data = (const unsigned char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == (const unsigned char*) MAP_FAILED) UNLIKELY {
+        return -1;
+    }
+
+    *hash = __hash64(data, size, 0);
+
+#ifdef __linux__
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*) data;
+    if (size >= sizeof(Elf64_Ehdr) && memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 &&
+        eh->e_ident[EI_CLASS] == ELFCLASS64 && eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr) <= size) {
+        const Elf64_Shdr* sections = (const Elf64_Shdr*) (data + eh->e_shoff);
+
+        for (int s = 0; s < eh->e_shnum; s++) {
+            const Elf64_Shdr* dynsym = &sections[s];
+            if (dynsym->sh_type != SHT_DYNSYM || dynsym->sh_link >= eh->e_shnum ||
+                dynsym->sh_offset + dynsym->sh_size > size) {
+                continue;
+            }
+            const Elf64_Shdr* strtab = &sections[dynsym->sh_link];
+            if (strtab->sh_offset + strtab->sh_size > size) {
+                continue;
+            }
+
+            const Elf64_Sym* syms = (const Elf64_Sym*) (data + dynsym->sh_offset);
+            const size_t nsyms = dynsym->sh_size / sizeof(Elf64_Sym);
+            const char* names = (const char*) (data + strtab->sh_offset);
+
+            uint64_t* keys = (uint64_t*) malloc((nsyms + 1) * sizeof(uint64_t));
+            if (!keys) UNLIKELY {
+                break;
+            }
+
+            size_t nkeys = 0;
+            for (size_t k = 1; k < nsyms; k++) {
+                const Elf64_Sym* sym = &syms[k];
+                const int type = ELF64_ST_TYPE(sym->st_info);
+                const int visibility = ELF64_ST_VISIBILITY(sym->st_other);
+                if (sym->st_shndx == SHN_UNDEF || ELF64_ST_BIND(sym->st_info) == STB_LOCAL ||
+                    visibility == STV_HIDDEN || visibility == STV_INTERNAL || sym->st_name >= strtab->sh_size) {
+                    continue;
+                }
+
+                const char* name = names + sym->st_name;
+                uint64_t key = __hash64(name, strnlen(name, strtab->sh_size - sym->st_name), sym->st_info);
+                if (type == STT_OBJECT || type == STT_TLS) {
+                    key = __hash64(&sym->st_size, sizeof(sym->st_size), key);
+                }
+                keys[nkeys++] = key;
+            }
+
+            // The order of .dynsym is the linker's business.
+            qsort(keys, nkeys, sizeof(uint64_t), __abi_cmp);
+            *hash = __hash64(keys, nkeys * sizeof(uint64_t), 0x746F63 /* "toc" */);
+            free(keys);
+            break;
+        }
+    }
+#endif
+
+    munmap((void*) data, size);
+    return 0;
+}
+
+/**
+ * Brings the interface file of a shared library job up to date.
+ */
+static short __toc_write(const __job_t* job)
+{
+    uint64_t hash = 0;
+    if (__abi_hash(job->output, &hash) != 0) UNLIKELY {
+        fprintf(stderr, "nobuild: cannot read the interface of '%s'\n", job->output);
+        return -1;
+    }
+
+    char text[32];
+    const int len = snprintf(text, sizeof(text), "%016llx\n", (unsigned long long) hash);
+    return __write_if_changed(job->__toc, text, len);
+}
+
+/*
+ * Command lines too long for execve() (ARG_MAX counts the environment
+ * too) are passed through a response file: the job then runs as
+ * `cc @<output>.rsp`, which gcc and clang expand, so even a link of
+ * thousands of objects stays a single process. The file is removed once
+ * the job succeeded.
+ */
+static size_t __argv_limit(void)
+{
+    static size_t limit = 0;
+    if (limit == 0) {
+        long max = sysconf(_SC_ARG_MAX);
+        size_t env = 0;
+        for (char** e = environ; e && *e; e++) {
+            env += strlen(*e) + 1 + sizeof(char*);
+        }
+        max = (max > 0) ? max : 128 * 1024;
+        limit = ((size_t) max > env + 4096) ? (size_t) max - env - 4096 : 1;
+    }
+    return limit;
+}
+
+/**
+ * Writes argv[1..] to 'path', quoted for gcc's @file expansion, with a
+ * single write() of a buffer built up front.
+ */
+static short __rsp_write(const char* path, char** argv)
+{
+    size_t size = 0;
+    for (char** a = argv + 1; *a; a++) LIKELY {
+        size += 2 * strlen(*a) + 1; // worst case: every byte escaped
+    }
+
+    char* buffer = (char*) malloc(size + 1);
+    if (!buffer) UNLIKELY {
+        perror("malloc");
+        return -1;
+    }
+
+    char* p = buffer;
+    for (char** a = argv + 1; *a; a++) LIKELY {
+        for (const char* c = *a; *c; c++) {
+            if (strchr(" \t\n\r\f\v'\"\\", *c)) {
+                *p++ = '\\';
+            }
+            *p++ = *c;
+        }
+        *p++ = '\n';
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    short result = (fd >= 0 && __write_all(fd, buffer, p - buffer) == 0) ? 0 : -1;
+    if (fd >= 0 && close(fd) != 0) {
+        result = -1;
+    }
+    if (result != 0) UNLIKELY {
+        perror(path);
+    }
+
+    free(buffer);
+    return result;
+}
+
+static void __rsp_path(const __job_t* job, char* path, size_t size)
+{
+    snprintf(path, size, "%s.rsp", job->output);
+}
+
+/**
+ * Spawns a job's command line, moving it to a response file first if it
+ * does not fit in ARG_MAX.
+ */
+static pid_t __spawn_job(__job_t* job, int out)
+{
+    size_t bytes = 0;
+    for (char** a = job->argv; *a; a++) LIKELY {
+        bytes += strlen(*a) + 1 + sizeof(char*);
+    }
+
+    if (bytes <= __argv_limit()) LIKELY {
+        return __spawn(job->argv, out);
+    }
+
+    char path[OUT_CAPACITY + 8];
+    __rsp_path(job, path, sizeof(path));
+    char at[sizeof(path) + 1];
+    snprintf(at, sizeof(at), "@%s", path);
+    if (__rsp_write(path, job->argv) != 0) UNLIKELY {
+        return -1;
+    }
+
+    job->__rsp = 1;
+    char* argv[] = { job->argv[0], at, NULL };
+    return __spawn(argv, out);
+}
+
+static void __rsp_remove(__job_t* job)
+{
+    if (job->__rsp) {
+        char path[OUT_CAPACITY + 8];
+        __rsp_path(job, path, sizeof(path));
+        unlink(path);
+        job->__rsp = 0;
+    }
+}
+
+/**
+ * Runs a job's command line and waits for it, from a helper process.
+ * Returns its exit status.
+ */
+static int __job_exec(__job_t* job)
+{
+    pid_t pid = __spawn_job(job, -1);
+    int status = 0;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (pid < 0 || !WIFEXITED(status)) UNLIKELY {
+        return EXIT_FAILURE;
+    }
+    if (WEXITSTATUS(status) == 0) {
+        __rsp_remove(job);
+    }
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Runs 'argv' and returns what it printed on stdout (its size stored into
+ * '*len'), or NULL if it could not run or failed. The child's stderr goes
+ * to /dev/null if 'quiet' is 1, along with stdout if it is 2, to ours
+ * otherwise.
+ */
+static char* __run_output(char** argv, int quiet, size_t* len)
+{
+    int fds[2];
+    if (pipe(fds) != 0) UNLIKELY {
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = (quiet == 1) ? open("/dev/null", O_WRONLY) : -1;
+        dup2(fds[1], STDOUT_FILENO);
+        if (null >= 0) {
+            dup2(null, STDERR_FILENO);
+        }
+        if (quiet == 2) {
+            dup2(fds[1], STDERR_FILENO);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+
+    size_t capacity = 1 << 16;
+    char* text = (pid > 0) ? (char*) malloc(capacity) : NULL;
+    *len = 0;
+    for (ssize_t r = 1; text && r != 0;) {
+        if (*len == capacity) {
+            char* grown = (char*) realloc(text, capacity *= 2);
+            if (!grown) UNLIKELY {
+                free(text);
+                text = NULL;
+                break;
+            }
+            text = grown;
+        }
+
+        r = read(fds[0], text + *len, capacity - *len);
+        if (r < 0 && errno != EINTR) UNLIKELY {
+            free(text);
+            text = NULL;
+            break;
+        }
+        *len += (r > 0) ? (size_t) r : 0;
+    }
+    close(fds[0]);
+
+    int status = -1;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (text && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        free(text);
+        text = NULL;
+    }
+    return text;
+}
+
+
+
+/************************************************************
+ * Remote Cache
+ ************************************************************/
+
+/*
+ * A remote cache is a cache_backend_t: a pair of batch callbacks moving
+ * blobs between local files and a shared store, plus their context. They
+ * only ever run in forked helpers, so a slow store delays the affected
+ * jobs but neither the scheduler nor the compile slots. Blobs are named by
+ * 64 hex digits derived from the cache key and the entry extension.
+ */
+static struct __remote {
+    cache_backend_t backend;
+    int enabled;
+    int configured;
+    int drain[2];           /* Held open by upload helpers (see __remote_drain()). */
+} __nob_remote = { { NULL, NULL, NULL }, 0, 0, { -1, -1 } };
+
+void SET_REMOTE_CACHE(const cache_backend_t* backend)
+{
+    __nob_remote.configured = 1;
+    __nob_remote.enabled    = (backend && backend->get && backend->put);
+    if (__nob_remote.enabled) {
+        __nob_remote.backend = *backend;
+    }
+}
+
+static void __remote_name(uint64_t key, const char* ext, char name[65])
+{
+    for (int w = 0; w < 4; w++) {
+        uint64_t word = __hash64(&key, sizeof(key), __hash_str(ext, w));
+        snprintf(name + 16 * w, 17, "%016llx", (unsigned long long) word);
+    }
+}
+
+/**
+ * Upload helpers inherit the write end of the drain pipe (close-on-exec, so
+ * compilers never do). Once the scheduler closes its own copy, reading the
+ * pipe hits EOF exactly when the last upload finished.
+ */
+static void __remote_begin(void)
+{
+    if (__nob_remote.enabled && __nob_remote.drain[0] < 0) {
+        if (pipe(__nob_remote.drain) == 0) LIKELY {
+            fcntl(__nob_remote.drain[0], F_SETFD, FD_CLOEXEC);
+            fcntl(__nob_remote.drain[1], F_SETFD, FD_CLOEXEC);
+        }
+    }
+}
+
+static void __remote_drain(void)
+{
+    if (__nob_remote.drain[0] < 0) {
+        return;
+    }
+
+    close(__nob_remote.drain[1]);
+
+    char byte;
+    while (read(__nob_remote.drain[0], &byte, 1) < 0 && errno == EINTR) {}
+
+    close(__nob_remote.drain[0]);
+    __nob_remote.drain[0] = __nob_remote.drain[1] = -1;
+}
+
+
+/*
+ * HTTP/1.1 backend. Blobs live at '<url>/ac/<name>', which is the action
+ * cache endpoint of bazel-remote (run it with --disable_http_ac_validation,
+ * since the blobs are not ActionResult messages). Every batch travels on a
+ * single keep-alive connection: all requests are written first and the
+ * responses are read back in order. Only plain http:// and bodies with a
+ * Content-Length are supported.
+ */
+typedef struct __http {
+    char host[256];
+    char port[16];
+    char prefix[512];
+} __http_t;
+
+typedef struct __http_reader {
+    int fd;
+    size_t pos, len;
+    char buffer[1 << 14];
+} __http_reader_t;
+
+/**
+ * Connects to 'host':'port' with 30 s timeouts (connect() included).
+ */
+static int __tcp_connect(const char* host, const char* port)
+{
+    struct addrinfo hints, *info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &info) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* a = info; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct timeval timeout = { 30, 0 };
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+static int __http_connect(const __http_t* http)
+{
+    return __tcp_connect(http->host, http->port);
+}
+
+static ssize_t __http_fill(__http_reader_t* r)
+{
+    r->pos = 0;
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buffer, sizeof(r->buffer));
+    } while (n < 0 && errno == EINTR);
+    r->len = (n > 0) ? (size_t) n : 0;
+    return n;
+}
+
+/**
+ * Reads one response head, returning the status code and storing the
+ * Content-Length (-1 if absent) into '*length'.
+ */
+static int __http_head(__http_reader_t* r, long long* length)
+{
+    char line[1024];
+    int status = -1;
+    *length = -1;
+
+    for (;;) {
+        size_t n = 0;
+        for (;;) {
+            if (r->pos == r->len && __http_fill(r) <= 0) {
+                return -1;
+            }
+            char c = r->buffer[r->pos++];
+            if (c == '\n') {
+                break;
+            }
+            if (c != '\r' && n < sizeof(line) - 1) {
+                line[n++] = c;
+            }
+        }
+        line[n] = '\0';
+
+        if (n == 0) {
+            return status;
+        }
+        if (status < 0) {
+            const char* space = strchr(line, ' ');
+            status = space ? atoi(space + 1) : 0;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            *length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            status = 0; // Chunked bodies are not supported.
+        }
+    }
+}
+
+/**
+ * Consumes a body of 'length' bytes, writing it to 'out' unless it is -1.
+ */
+static short __http_body(__http_reader_t* r, long long length, int out)
+{
+    while (length > 0) {
+        if (r->pos == r->len && __http_fill(r) <= 0) {
+            return -1;
+        }
+        size_t chunk = r->len - r->pos;
+        if ((long long) chunk > length) {
+            chunk = (size_t) length;
+        }
+        if (out >= 0 && __write_all(out, r->buffer + r->pos, chunk) != 0) {
+            return -1;
+        }
+        r->pos += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+static int __http_get(void* ctx, int n, const char* const* names, const char* const* paths)
+{
+    const __http_t* http = (const __http_t*) ctx;
+    int fd = __http_connect(http);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char request[1024];
+    for (int k = 0; k < n; k++) {
+        int len = snprintf(request, sizeof(request),
+                           "GET %s/ac/%s HTTP/1.1\r\nHost: %s\r\n\r\n", http->prefix, names[k], http->host);
+        if (__write_all(fd, request, len) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    __http_reader_t* reader = (__http_reader_t*) malloc(sizeof(__http_reader_t));
+    int result = reader ? 0 : -1;
+    if (reader) {
+        reader->fd  = fd;
+        reader->pos = reader->len = 0;
+    }
+
+    for (int k = 0; k < n && result == 0; k++) {
+        long long length = -1;
+        int status = __http_head(reader, &length);
+        if (status != 200 || length < 0) {
+            result = -1;
+            break;
+        }
+
+        int out = open(paths[k], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        result = (out >= 0 && __http_body(reader, length, out) == 0) ? 0 : -1;
+        if (out >= 0 && close(out) != 0) {
+            result = -1;
+        }
+    }
+
+    free(reader);
+    close(fd);
+    return result;
+}
+
+static int __http_put(void* ctx, int n, const char* const* names, const char* const* paths)
+{
+    const __http_t* http = (const __http_t*) ctx;
+    int fd = __http_connect(http);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = 0;
+    char request[1024], buffer[1 << 14];
+    for (int k = 0; k < n && result == 0; k++) {
+        int in = open(paths[k], O_RDONLY);
+        struct stat st;
+        if (in < 0 || fstat(in, &st) != 0) {
+            if (in >= 0) {
+                close(in);
+            }
+            result = -1;
+            break;
+        }
+
+        int len = snprintf(request, sizeof(request),
+                           "PUT %s/ac/%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %lld\r\n\r\n",
+                           http->prefix, names[k], http->host, (long long) st.st_size);
+        result = __write_all(fd, request, len);
+
+        for (ssize_t r; result == 0 && (r = read(in, buffer, sizeof(buffer))) != 0;) {
+            if (r < 0) {
+                result = (errno == EINTR) ? 0 : -1;
+                continue;
+            }
+            result = __write_all(fd, buffer, r);
+        }
+        close(in);
+    }
+
+    __http_reader_t* reader = (result == 0) ? (__http_reader_t*) malloc(sizeof(__http_reader_t)) : NULL;
+    if (reader) {
+        reader->fd  = fd;
+        reader->pos = reader->len = 0;
+    }
+
+    for (int k = 0; reader && k < n && result == 0; k++) {
+        long long length = -1;
+        int status = __http_head(reader, &length);
+        result = (status >= 200 && status < 300 && __http_body(reader, length, -1) == 0) ? 0 : -1;
+    }
+
+    free(reader);
+    close(fd);
+    return result;
+}
+
+cache_backend_t HTTP_CACHE(const char* url)
+{
+    cache_backend_t backend = { NULL, NULL, NULL };
+
+    if (!url || strncmp(url, "http://", 7) != 0) {
+        fprintf(stderr, "nobuild: unsupported remote cache URL '%s'\n", url ? url : "");
+        return backend;
+    }
+
+    __http_t* http = (__http_t*) calloc(1, sizeof(__http_t));
+    if (!http) UNLIKELY {
+        perror("calloc");
+        return backend;
+    }
+
+    const char* host = url + 7;
+    size_t len  = strcspn(host, ":/");
+    snprintf(http->host, sizeof(http->host), "%.*s", (int) len, host);
+
+    const char* rest = host + len;
+    if (*rest == ':') {
+        size_t plen = strcspn(rest + 1, "/");
+        snprintf(http->port, sizeof(http->port), "%.*s", (int) plen, rest + 1);
+        rest += 1 + plen;
+    } else {
+        snprintf(http->port, sizeof(http->port), "80");
+    }
+
+    snprintf(http->prefix, sizeof(http->prefix), "%s", rest);
+    size_t plen = strlen(http->prefix);
+    if (plen > 0 && http->prefix[plen - 1] == '/') {
+        http->prefix[plen - 1] = '\0';
+    }
+
+    backend.get = __http_get;
+    backend.put = __http_put;
+    backend.ctx = http;
+    return backend;
+}
+
+static void __remote_open(void)
+{
+    if (!__nob_remote.configured) {
+        __nob_remote.configured = 1;
+
+        const char* url = getenv("NOB_REMOTE_CACHE");
+        if (url && url[0]) {
+            cache_backend_t backend = HTTP_CACHE(url);
+            SET_REMOTE_CACHE(&backend);
+        }
+    }
+
+    __remote_begin();
+}
+
+
+
+/************************************************************
+ * Remote Execution
+ ************************************************************/
+
+/*
+ * An executor takes compile jobs the local job slots have no room for. Each
+ * one runs in a forked helper calling executor_t::compile(), which the pool
+ * watches like any other child. A helper turned down by the executor exits
+ * with __EXEC_DECLINED, and the pool queues the job again for a local slot.
+ * Helpers still preprocess locally, which takes one of __jobs_limit()
+ * tokens of their own (see __exec_pp_acquire()), so offloading at most
+ * doubles the local processes instead of adding one per executor slot.
+ *
+ * TCP_EXECUTOR() and SERVE_WORKER() speak a minimal binary protocol, in
+ * native byte order since both ends have to target the same machine
+ * anyway. A connection carries requests that are answered in order, and
+ * clients keep it for their next jobs (see __tcp_park()):
+ *
+ *     request:   "NOBX"  u32 argc  argc * (u32 size, bytes)  u64 size, source
+ *     response:  i32 status  u64 size, diagnostics  u64 size, object
+ *
+ * The source is preprocessed and the command line stripped of its output,
+ * of its preprocessor options (macros, search paths, depfiles, included
+ * files) and of the source, ending with
+ * `-x <language>-cpp-output`: the worker appends `-o <object> <source>`
+ * for the files it received. A status of __WORKER_BUSY turns the request
+ * down without running anything, be it for lack of a slot or because the
+ * worker refuses the command line.
+ */
+#define __WORKER_MAGIC 0x58424F4Eu  /* "NOBX" */
+#define __WORKER_BUSY  (-2)
+#define __WORKER_SLOTS 16           /* Per worker, unless given. */
+#define __WORKER_ARGS  4096         /* Arguments a worker accepts. */
+#define __EXEC_DECLINED 75          /* Helper exit status: compile the job locally (EX_TEMPFAIL). */
+
+static struct __exec {
+    executor_t executor;
+    int enabled;
+    int configured;
+    int pp[2];              /* Preprocessing tokens, one byte each, during a pool run. */
+} __nob_exec = { { NULL, 0, NULL }, 0, 0, { -1, -1 } };
+
+void SET_EXECUTOR(const executor_t* executor)
+{
+    __nob_exec.configured = 1;
+    __nob_exec.enabled    = (executor && executor->compile && executor->slots > 0);
+    if (__nob_exec.enabled) {
+        __nob_exec.executor = *executor;
+    }
+}
+
+static void __exec_pp_open(int tokens)
+{
+    if (pipe(__nob_exec.pp) != 0) UNLIKELY {
+        __nob_exec.pp[0] = __nob_exec.pp[1] = -1;
+        return;
+    }
+    fcntl(__nob_exec.pp[0], F_SETFD, FD_CLOEXEC);
+    fcntl(__nob_exec.pp[1], F_SETFD, FD_CLOEXEC);
+    for (int t = 0; t < tokens; t++) {
+        __write_all(__nob_exec.pp[1], "+", 1);
+    }
+}
+
+static void __exec_pp_close(void)
+{
+    if (__nob_exec.pp[0] >= 0) {
+        close(__nob_exec.pp[0]);
+        close(__nob_exec.pp[1]);
+        __nob_exec.pp[0] = __nob_exec.pp[1] = -1;
+    }
+}
+
+/**
+ * Waits for a preprocessing token, in an offloaded helper about to run
+ * `cc -E`. Returns 1 if one was taken (to give back with
+ * __exec_pp_release()), 0 outside of a pool run.
+ */
+static int __exec_pp_acquire(void)
+{
+    char token;
+    ssize_t n = -1;
+    while (__nob_exec.pp[0] >= 0 && (n = read(__nob_exec.pp[0], &token, 1)) < 0 && errno == EINTR) {}
+    return n == 1;
+}
+
+static void __exec_pp_release(int taken)
+{
+    if (taken) {
+        __write_all(__nob_exec.pp[1], "+", 1);
+    }
+}
+
+static short __send_all(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static short __recv_all(int fd, void* data, size_t len)
+{
+    char* p = (char*) data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Moves 'size' bytes from socket 'in' to 'out', or discards them if 'out'
+ * is -1.
+ */
+static short __recv_into(int in, int out, uint64_t size)
+{
+    char buffer[1 << 16];
+    while (size > 0) {
+        const size_t chunk = (size > sizeof(buffer)) ? sizeof(buffer) : (size_t) size;
+        if (__recv_all(in, buffer, chunk) != 0 || (out >= 0 && __write_all(out, buffer, chunk) != 0)) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Sends the file at 'path' as a u64 size followed by its contents, or an
+ * empty blob if it cannot be read.
+ */
+static short __send_file(int fd, const char* path)
+{
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    uint64_t size = (in >= 0 && fstat(in, &st) == 0) ? (uint64_t) st.st_size : 0;
+    short result = __send_all(fd, &size, sizeof(size));
+
+    char buffer[1 << 16];
+    while (result == 0 && size > 0) {
+        const ssize_t n = read(in, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        result = (n > 0 && (uint64_t) n <= size) ? __send_all(fd, buffer, n) : -1;
+        size  -= (n > 0) ? (uint64_t) n : 0;
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    return result;
+}
+
+typedef struct __worker {
+    char host[256];
+    char port[16];
+} __worker_t;
+
+/*
+ * Idle worker connections are parked, between jobs, in a datagram socket
+ * pair made by TCP_EXECUTOR(): a helper done with a connection sends it
+ * with SCM_RIGHTS, and the kernel keeps it open for the next helper to
+ * receive, whichever process runs it. A connection thus serves job after
+ * job while no process, not even the scheduler, holds on to it.
+ */
+typedef struct __workers {
+    __worker_t* list;
+    int count;
+    int idle[2];            /* Parked connections (read end, write end). */
+} __workers_t;
+
+/**
+ * Parks the connection 'fd' to worker 'index', or closes it if it cannot
+ * be parked.
+ */
+static void __tcp_park(const __workers_t* workers, int fd, int32_t index)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &index, sizeof(index) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(workers->idle[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno == EINTR) {}
+    close(fd);
+}
+
+/**
+ * Takes a parked connection, storing its worker into '*index'. Returns -1
+ * if none is parked.
+ */
+static int __tcp_unpark(const __workers_t* workers, int* index)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    int32_t value = -1;
+    struct iovec iov = { &value, sizeof(value) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(workers->idle[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {}
+
+    struct cmsghdr* cmsg = (n == (ssize_t) sizeof(value)) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int fd = -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (value < 0 || value >= workers->count) UNLIKELY {
+        close(fd);
+        return -1;
+    }
+    *index = value;
+    return fd;
+}
+
+/**
+ * The `-x` language of the preprocessed output of 'source' (or of the
+ * language given with `-x`, if any).
+ */
+static const char* __worker_language(const char* lang, const char* source)
+{
+    if (!lang) {
+        const char* dot = strrchr(source, '.');
+        lang = (!dot || strcmp(dot, ".c") == 0) ? "c"
+             : (strcmp(dot, ".m") == 0)         ? "objective-c"
+             : (strcmp(dot, ".mm") == 0)        ? "objective-c++" : "c++";
+    }
+    return (strcmp(lang, "c") == 0)               ? "cpp-output"
+         : (strcmp(lang, "objective-c") == 0)     ? "objective-c-cpp-output"
+         : (strcmp(lang, "objective-c++") == 0)   ? "objective-c++-cpp-output" : "c++-cpp-output";
+}
+
+/**
+ * Options taking a value that the worker must not see: outputs, and files
+ * or directories already pasted into the preprocessed source.
+ */
+static int __worker_local_flag(const char* arg)
+{
+    static const char* const local[] = {
+        "-o", "-MF", "-MT", "-MQ", "-include", "-include-pch", "-imacros", "-x",
+        "-I", "-D", "-U", "-isystem", "-iquote", "-idirafter",
+    };
+    for (size_t f = 0; f < sizeof(local) / sizeof(local[0]); f++) {
+        if (strcmp(arg, local[f]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Options that only matter to the preprocessor, which already ran: macros,
+ * search paths and depfile generation.
+ */
+static int __worker_pp_flag(const char* arg)
+{
+    return strncmp(arg, "-I", 2) == 0 || strncmp(arg, "-D", 2) == 0 || strncmp(arg, "-U", 2) == 0 ||
+           strncmp(arg, "-M", 2) == 0 || strncmp(arg, "-isystem", 8) == 0 || strncmp(arg, "-iquote", 7) == 0 ||
+           strncmp(arg, "-idirafter", 10) == 0;
+}
+
+static int __tcp_compile(void* ctx, char* const* argv, const char* source, const char* object)
+{
+    const __workers_t* workers = (const __workers_t*) ctx;
+    int argc = 0;
+    while (argv[argc]) {
+        argc++;
+    }
+
+    // `cc ... -MMD -MF <dep> -MT <obj> -E <src>` writes the depfile here, and
+    // `cc ... -c -x <lang>-cpp-output` is what the worker runs.
+    char** pp     = (char**) calloc(argc + 4, sizeof(char*));
+    char** remote = (char**) calloc(argc + 3, sizeof(char*));
+    if (!pp || !remote) UNLIKELY {
+        free(pp);
+        free(remote);
+        return -1;
+    }
+
+    int npp = 0, nremote = 0, depfile = 0;
+    const char* lang = NULL;
+    for (int a = 0; a < argc; a++) {
+        if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+            a++;
+            continue;
+        }
+        if (strcmp(argv[a], "-c") != 0) {
+            pp[npp++] = argv[a];
+        }
+
+        if (__worker_local_flag(argv[a]) && a + 1 < argc) {
+            if (strcmp(argv[a], "-x") == 0) {
+                lang = argv[a + 1];
+            }
+            depfile |= (strcmp(argv[a], "-MF") == 0);
+            pp[npp++] = argv[++a];
+        } else if (a == 0) {
+            const char* slash = strrchr(argv[0], '/');
+            remote[nremote++] = (char*) (slash ? slash + 1 : argv[0]);
+        } else if (!__worker_pp_flag(argv[a]) && strcmp(argv[a], source) != 0) {
+            remote[nremote++] = argv[a];
+        }
+    }
+    if (depfile) {
+        pp[npp++] = (char*) "-MT";
+        pp[npp++] = (char*) object;
+    }
+    pp[npp++] = (char*) "-E";
+    remote[nremote++] = (char*) "-x";
+    remote[nremote++] = (char*) __worker_language(lang, source);
+
+    size_t len = 0;
+    const int token = __exec_pp_acquire();
+    char* text = __run_output(pp, 0, &len);
+    __exec_pp_release(token);
+    free(pp);
+    if (!text) {
+        // The compiler would fail the same way, and already said why.
+        free(remote);
+        return EXIT_FAILURE;
+    }
+
+    // The request is the same for every worker.
+    size_t size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    for (int a = 0; a < nremote; a++) {
+        size += sizeof(uint32_t) + strlen(remote[a]);
+    }
+    char* request = (char*) malloc(size);
+    int status = -1;
+    if (request) LIKELY {
+        char* p = request;
+        const uint32_t magic = __WORKER_MAGIC, count = (uint32_t) nremote;
+        memcpy(p, &magic, sizeof(magic));
+        memcpy(p + sizeof(magic), &count, sizeof(count));
+        p += 2 * sizeof(uint32_t);
+        for (int a = 0; a < nremote; a++) {
+            const uint32_t alen = (uint32_t) strlen(remote[a]);
+            memcpy(p, &alen, sizeof(alen));
+            memcpy(p + sizeof(alen), remote[a], alen);
+            p += sizeof(alen) + alen;
+        }
+        const uint64_t tlen = len;
+        memcpy(p, &tlen, sizeof(tlen));
+    }
+
+    // Parked connections go first, whatever their worker. New ones start
+    // from a different worker in every helper, and move on when one is
+    // busy (a worker answers every request of a connection it had no slot
+    // for as busy, so such a connection is not parked).
+    const int first = (int) (getpid() % workers->count);
+    int reuses = workers->count;
+    for (int w = 0; request && status < 0 && w < workers->count;) {
+        int index = -1;
+        int fd = (reuses > 0) ? __tcp_unpark(workers, &index) : -1;
+        reuses = (fd >= 0) ? reuses - 1 : 0;
+        if (fd < 0) {
+            index = (first + w++) % workers->count;
+            fd = __tcp_connect(workers->list[index].host, workers->list[index].port);
+            if (fd < 0) {
+                continue;
+            }
+        }
+        struct timeval timeout = { 600, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        int32_t code = __WORKER_BUSY;
+        uint64_t diag = 0, obj = 0;
+        int clean = 0;
+        const int answered = __send_all(fd, request, size) == 0 && __send_all(fd, text, len) == 0 &&
+                             __recv_all(fd, &code, sizeof(code)) == 0;
+        if (answered && code != __WORKER_BUSY &&
+            __recv_all(fd, &diag, sizeof(diag)) == 0 && __recv_into(fd, STDERR_FILENO, diag) == 0 &&
+            __recv_all(fd, &obj, sizeof(obj)) == 0) {
+            int out = (code == 0) ? open(object, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+            if ((code != 0 || out >= 0) && __recv_into(fd, out, obj) == 0) {
+                status = (code >= 0) ? code : EXIT_FAILURE;
+                clean = 1;
+            }
+            if (out >= 0 && close(out) != 0) {
+                status = -1;
+            }
+            if (status != 0 && code == 0) {
+                unlink(object);
+            }
+        }
+
+        // A parked connection the worker dropped meanwhile is just retried.
+        if (clean) {
+            __tcp_park(workers, fd, index);
+        } else {
+            close(fd);
+        }
+    }
+
+    free(request);
+    free(text);
+    free(remote);
+    return status;
+}
+
+executor_t TCP_EXECUTOR(const char* workers)
+{
+    executor_t executor = { NULL, 0, NULL };
+
+    __workers_t* ctx = (__workers_t*) calloc(1, sizeof(__workers_t));
+    const size_t capacity = workers ? strlen(workers) / 2 + 1 : 0;
+    __worker_t* list = (ctx && capacity) ? (__worker_t*) calloc(capacity, sizeof(__worker_t)) : NULL;
+    if (!list) {
+        free(ctx);
+        return executor;
+    }
+
+    for (const char* w = workers; *w;) {
+        const size_t len = strcspn(w, ",");
+        const size_t addr = strcspn(w, "/,");
+        const size_t host = strcspn(w, ":/,");
+        if (host > 0) {
+            __worker_t* worker = &list[ctx->count++];
+            snprintf(worker->host, sizeof(worker->host), "%.*s", (int) host, w);
+            if (host < addr) {
+                snprintf(worker->port, sizeof(worker->port), "%.*s", (int) (addr - host - 1), w + host + 1);
+            } else {
+                snprintf(worker->port, sizeof(worker->port), "3633");
+            }
+            const int slots = (addr < len) ? atoi(w + addr + 1) : 0;
+            executor.slots += (slots > 0) ? slots : __WORKER_SLOTS;
+        }
+        w += len + (w[len] == ',');
+    }
+
+    if (ctx->count == 0) {
+        free(list);
+        free(ctx);
+        executor.slots = 0;
+        return executor;
+    }
+
+    // Without a place to park them, connections are simply not reused.
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, ctx->idle) != 0) UNLIKELY {
+        ctx->idle[0] = ctx->idle[1] = -1;
+    }
+
+    ctx->list        = list;
+    executor.compile = __tcp_compile;
+    executor.ctx     = ctx;
+    return executor;
+}
+
+static void __exec_open(void)
+{
+    if (!__nob_exec.configured) {
+        __nob_exec.configured = 1;
+
+        const char* workers = getenv("NOB_WORKERS");
+        if (workers && workers[0]) {
+            executor_t executor = TCP_EXECUTOR(workers);
+            SET_EXECUTOR(&executor);
+        }
+    }
+}
+
+/**
+ * Body of an offloaded compile, in its helper, through the executor.
+ * Returns the exit status, __EXEC_DECLINED if the executor turned the job
+ * down.
+ */
+static int __exec_compile(__job_t* job)
+{
+    fflush(stdout);
+    const int status = __nob_exec.executor.compile(__nob_exec.executor.ctx, job->argv, job->inputs[0], job->output);
+    return (status < 0) ? __EXEC_DECLINED : (status == __EXEC_DECLINED) ? EXIT_FAILURE : status;
+}
+
+static pid_t __spawn_offload(__job_t* job, int out)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+            dup2(out, STDERR_FILENO);
+        }
+        int status = __exec_compile(job);
+        fflush(stdout);
+        _exit(status);
+    }
+    return pid;
+}
+
+/**
+ * The option in 'argv' a worker refuses to run, or NULL if there is none:
+ * anything but a compiler found in PATH, and any option but the ones a
+ * compile of preprocessed source needs (-c, -x <lang>-cpp-output, -O*,
+ * -W*, -std=*, -g*, -f*, -m*, -w, -pedantic*, -ansi and -pipe). Options
+ * that pass arguments to other tools, load or run code, dump or profile
+ * anywhere are refused among those, as is any argument holding a path or
+ * naming a response file: what the compiler writes stays in the request's
+ * directory.
+ */
+static const char* __worker_refused(char** argv, int argc)
+{
+    static const char* const exact[] = { "-c", "-w", "-ansi", "-pipe" };
+    static const char* const allowed[] = { "-O", "-W", "-std=", "-g", "-f", "-m", "-pedantic" };
+    static const char* const refused[] = {
+        "-Wa,", "-Wl,", "-Wp,", "-fplugin", "-fpass-plugin", "-fdump-", "-fprofile-", "-fauto-profile",
+        "-fopt-info", "-fcrash-diagnostics", "-fmodule", "-fsave-optimization-record", "-foptimization-record",
+    };
+
+    const char* cc = argv[0];
+    const int compiler = !strchr(cc, '/') && (strstr(cc, "gcc") || strstr(cc, "g++") || strstr(cc, "clang") ||
+                                               strcmp(cc, "cc") == 0 || strcmp(cc, "c++") == 0);
+    if (!compiler) {
+        return cc;
+    }
+
+    for (int a = 1; a < argc; a++) {
+        const char* arg = argv[a];
+        if (strchr(arg, '/') || arg[0] != '-') {
+            return arg;
+        }
+        if (strcmp(arg, "-x") == 0) {
+            const size_t len = (a + 1 < argc) ? strlen(argv[a + 1]) : 0;
+            if (len < 10 || strcmp(argv[a + 1] + len - 10, "cpp-output") != 0 || strchr(argv[a + 1], '/')) {
+                return arg;
+            }
+            a++;
+            continue;
+        }
+
+        int ok = 0;
+        for (size_t e = 0; e < sizeof(exact) / sizeof(exact[0]) && !ok; e++) {
+            ok = (strcmp(arg, exact[e]) == 0);
+        }
+        for (size_t p = 0; p < sizeof(allowed) / sizeof(allowed[0]) && !ok; p++) {
+            ok = (strncmp(arg, allowed[p], strlen(allowed[p])) == 0);
+        }
+        for (size_t r = 0; r < sizeof(refused) / sizeof(refused[0]) && ok; r++) {
+            ok = (strncmp(arg, refused[r], strlen(refused[r])) != 0);
+        }
+        if (!ok) {
+            return arg;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Compiles 'dir'/in into 'dir'/out.o with 'argv' (which has room for three
+ * more entries), the diagnostics going to 'dir'/log. Returns the exit
+ * status, or __WORKER_BUSY for a command line it refuses, which the client
+ * then compiles elsewhere.
+ */
+static int __worker_compile(char** argv, int argc, const char* dir)
+{
+    char log[PATH_MAX];
+    snprintf(log, sizeof(log), "%s/log", dir);
+
+    const char* refused = __worker_refused(argv, argc);
+    if (refused) {
+        fprintf(stderr, "nobuild: worker refuses to run '%s'\n", refused);
+        return __WORKER_BUSY;
+    }
+
+    argv[argc++] = (char*) "-o";
+    argv[argc++] = (char*) "out.o";
+    argv[argc++] = (char*) "in";
+    argv[argc]   = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || chdir(dir) != 0) {
+            _exit(EXIT_FAILURE);
+        }
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+
+    int status = 0;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    return (pid > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/**
+ * Serves the requests of one connection, in a forked process, until the
+ * client closes it. Returns the process exit status.
+ */
+static int __worker_serve(int fd, int busy)
+{
+    char dir[] = "/tmp/nobuild-worker-XXXXXX";
+    if (!mkdtemp(dir)) UNLIKELY {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char in[sizeof(dir) + 8], out[sizeof(dir) + 8], log[sizeof(dir) + 8];
+    snprintf(in, sizeof(in), "%s/in", dir);
+    snprintf(out, sizeof(out), "%s/out.o", dir);
+    snprintf(log, sizeof(log), "%s/log", dir);
+
+    int result = 0;
+    for (;;) {
+        uint32_t header[2];
+        if (__recv_all(fd, header, sizeof(header)) != 0) {
+            break; // Closed.
+        }
+        if (header[0] != __WORKER_MAGIC || header[1] == 0 || header[1] > __WORKER_ARGS) UNLIKELY {
+            result = EXIT_FAILURE;
+            break;
+        }
+
+        const int argc = (int) header[1];
+        char** argv = (char**) calloc(argc + 4, sizeof(char*));
+        int ok = (argv != NULL);
+        for (int a = 0; ok && a < argc; a++) {
+            uint32_t len = 0;
+            ok = (__recv_all(fd, &len, sizeof(len)) == 0 && len < PATH_MAX &&
+                  (argv[a] = (char*) calloc(len + 1, 1)) != NULL && __recv_all(fd, argv[a], len) == 0);
+        }
+
+        uint64_t size = 0;
+        int src = -1;
+        ok = ok && __recv_all(fd, &size, sizeof(size)) == 0 &&
+             (src = open(in, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 && __recv_into(fd, src, size) == 0;
+        if (src >= 0) {
+            close(src);
+        }
+
+        if (ok) {
+            unlink(out);
+            const int32_t status = busy ? __WORKER_BUSY : __worker_compile(argv, argc, dir);
+            ok = (__send_all(fd, &status, sizeof(status)) == 0) &&
+                 (status == __WORKER_BUSY || (__send_file(fd, log) == 0 && __send_file(fd, out) == 0));
+        }
+
+        for (int a = 0; argv && a < argc; a++) {
+            free(argv[a]);
+        }
+        free(argv);
+        if (!ok) {
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    unlink(in);
+    unlink(out);
+    unlink(log);
+    rmdir(dir);
+    close(fd);
+    return result;
+}
+
+short SERVE_WORKER(const char* port, int slots)
+{
+    if (slots <= 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        slots = (cpus > 0) ? (int) cpus : 1;
+    }
+
+    struct addrinfo hints, *info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    int fd = -1;
+    if (getaddrinfo(NULL, port, &hints, &info) == 0) {
+        // An IPv6 socket accepts IPv4 clients too (unless IPV6_V6ONLY).
+        fd = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, info->ai_protocol);
+        int one = 1;
+        if (fd >= 0 && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+                        bind(fd, info->ai_addr, info->ai_addrlen) != 0 || listen(fd, 128) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(info);
+    }
+    if (fd < 0) UNLIKELY {
+        perror("nobuild: worker");
+        return -1;
+    }
+
+    int active = 0;
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        while (active > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+            active--;
+        }
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            close(fd);
+            return -1;
+        }
+
+        // A client that stops sending must not hold a slot forever.
+        int one = 1;
+        struct timeval timeout = { 60, 0 };
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fd);
+            _exit(__worker_serve(client, active >= slots));
+        }
+        active += (pid > 0);
+        close(client);
+    }
+}
+
+
+
+/************************************************************
+ * Compilation Cache
+ ************************************************************/
+
+/*
+ * Objects of compile jobs are cached under '<dir>/<xx>/<key>.o', next to
+ * the depfile the compiler wrote for them ('<key>.d'), where 'xx' is the
+ * top byte of the key. Each object is stored under two keys, both starting
+ * from the compiler identity and the command line minus output paths:
+ *
+ *  - the direct key adds the contents of every file listed in the depfile
+ *    of the previous compile, so a hit costs no process at all, and the
+ *    compiler's system include directories with their mtimes (-MMD lists
+ *    no system header, see __system_id());
+ *  - the preprocessed key adds the output of `cc -E`, which also works on
+ *    a fresh checkout (no depfile yet) and across comment-only edits.
+ *
+ * Entries are placed with link() (reflink or copy across filesystems), so
+ * outputs and depfiles of compile jobs are always unlinked before the
+ * compiler runs: it never rewrites a file shared with the cache in place.
+ * An entry's mtime is its last use, which drives the LRU trimming.
+ */
+#define __CACHE_DEFAULT_SIZE (5LL << 30)
+#define __CACHE_RESTORED 76         /* Helper exit status: served from the cache, nothing compiled. */
+
+static struct __cache {
+    char dir[OUT_CAPACITY];
+    long long max_size;     /* Bytes the cache is trimmed down to. */
+    int configured;         /* SET_CACHE() was called. */
+    int enabled;
+    int stored;             /* Entries may have been added since the last trim. */
+} __nob_cache;
+
+void SET_CACHE(const char* dir, long long max_size)
+{
+    __nob_cache.configured = 1;
+    __nob_cache.enabled    = (dir != NULL && dir[0] != '\0');
+    __nob_cache.max_size   = (max_size > 0) ? max_size : __CACHE_DEFAULT_SIZE;
+    if (__nob_cache.enabled) {
+        strncpy(__nob_cache.dir, dir, OUT_CAPACITY - 1);
+    }
+}
+
+static void __cache_open(void)
+{
+    if (__nob_cache.configured) {
+        return;
+    }
+    __nob_cache.configured = 1;
+
+    const char* dir = getenv("NOB_CACHE_DIR");
+    if (!dir || !dir[0]) {
+        return;
+    }
+
+    long long size = 0;
+    const char* env = getenv("NOB_CACHE_SIZE");
+    if (env) {
+        size = __parse_size(env);
+    }
+
+    SET_CACHE(dir, size);
+}
+
+/**
+ * Identifies a compiler by its resolved path, size and mtime, so that an
+ * upgrade invalidates every entry it produced. Memoized per command.
+ */
+static uint64_t __compiler_id(const char* cmd)
+{
+    static struct { uint64_t cmd, id; } memo[8];
+    static int nmemo = 0;
+
+    const uint64_t key = __hash_str(cmd, 0);
+    for (int m = 0; m < nmemo; m++) {
+        if (memo[m].cmd == key) {
+            return memo[m].id;
+        }
+    }
+
+    char path[PATH_MAX] = {0};
+    struct stat st;
+    int found = 0;
+
+    if (strchr(cmd, '/')) {
+        found = (snprintf(path, sizeof(path), "%s", cmd) < (int) sizeof(path) && stat(path, &st) == 0);
+    } else {
+        const char* dirs = getenv("PATH");
+        while (dirs && *dirs && !found) {
+            size_t len = strcspn(dirs, ":");
+            found = (snprintf(path, sizeof(path), "%.*s/%s", (int) len, dirs, cmd) < (int) sizeof(path) &&
+                     stat(path, &st) == 0 && (st.st_mode & S_IXUSR));
+            dirs += len + (dirs[len] == ':');
+        }
+    }
+
+    uint64_t id = __hash_str(found ? path : cmd, 0);
+    if (found) {
+        int64_t meta[2] = { (int64_t) st.st_size, __MTIME_NS(st) };
+        id = __hash64(meta, sizeof(meta), id);
+    }
+
+    if (nmemo < (int) (sizeof(memo) / sizeof(memo[0]))) {
+        memo[nmemo].cmd = key;
+        memo[nmemo].id  = id;
+        nmemo++;
+    }
+    return id;
+}
+
+/**
+ * Identifies the system headers a compile job may include, which -MMD
+ * leaves out of its depfile: asks the compiler for its search list (`cc -E
+ * -v`, for C and C++, passing along the job's flags that move it) and
+ * hashes each directory from "#include <...>" on with its mtime, which
+ * changes whenever a package adds or replaces a header. Memoized per
+ * compiler and flags, so a build runs each probe once.
+ */
+static uint64_t __system_id(char** argv)
+{
+    static struct { uint64_t key, id; } memo[16];
+    static int nmemo = 0;
+
+    static const char* const valued[] = { "-isystem", "-isysroot", "--sysroot", "-target", "-idirafter" };
+    static const char* const prefixed[] = { "-isystem", "-isysroot", "--sysroot=", "--target=", "-idirafter",
+                                            "-nostdinc", "-nostdlibinc", "-stdlib=", "-m32", "-m64" };
+    const int nvalued   = (int) (sizeof(valued) / sizeof(valued[0]));
+    const int nprefixed = (int) (sizeof(prefixed) / sizeof(prefixed[0]));
+
+    int argc = 0;
+    while (argv[argc]) {
         argc++;
     }
+    char** probe = (char**) calloc(argc + 6, sizeof(char*));
+    if (!probe) UNLIKELY {
+        return 0;
+    }
+
+    int n = 0;
+    probe[n++] = argv[0];
+    for (int a = 1; a < argc; a++) LIKELY {
+        int keep = 0, value = 0;
+        for (int f = 0; f < nvalued && !keep; f++) {
+            keep = value = (strcmp(argv[a], valued[f]) == 0 && a + 1 < argc);
+        }
+        for (int f = 0; f < nprefixed && !keep; f++) {
+            keep = (strncmp(argv[a], prefixed[f], strlen(prefixed[f])) == 0);
+        }
+        if (keep) {
+            probe[n++] = argv[a];
+        }
+        if (value) {
+            probe[n++] = argv[++a];
+        }
+    }
+
+    uint64_t key = __hash_str("system", 0);
+    for (int k = 0; k < n; k++) {
+        key = __hash_str(probe[k], key);
+    }
+    for (int m = 0; m < nmemo; m++) {
+        if (memo[m].key == key) {
+            free(probe);
+            return memo[m].id;
+        }
+    }
+
+    uint64_t id = key;
+    const char* const langs[2] = { "c", "c++" };
+    for (int l = 0; l < 2; l++) {
+        int k = n;
+        probe[k++] = (char*) "-E";
+        probe[k++] = (char*) "-v";
+        probe[k++] = (char*) "-x";
+        probe[k++] = (char*) langs[l];
+        probe[k++] = (char*) "/dev/null";
+        probe[k]   = NULL;
+
+        size_t len = 0;
+        char* text = __run_output(probe, 2, &len);
+        if (!text) {
+            continue;
+        }
+
+        int listed = 0;
+        for (char* line = text; line < text + len;) {
+            char* end = (char*) memchr(line, '\n', text + len - line);
+            end = end ? end : text + len;
+            *end = '\0';
+
+            if (strncmp(line, "#include <", 10) == 0) {
+                listed = 1;
+            } else if (strncmp(line, "End of search list", 18) == 0) {
+                listed = 0;
+            } else if (listed && line[0] == ' ') {
+                // clang adds " (framework directory)" to some entries.
+                char* note = strstr(line, " (");
+                if (note) {
+                    *note = '\0';
+                }
+
+                struct stat st;
+                const int64_t mtime = (stat(line + 1, &st) == 0) ? __MTIME_NS(st) : -1;
+                id = __hash_str(line + 1, id);
+                id = __hash64(&mtime, sizeof(mtime), id);
+            }
+            line = end + 1;
+        }
+        free(text);
+    }
+    free(probe);
+
+    if (nmemo < (int) (sizeof(memo) / sizeof(memo[0]))) {
+        memo[nmemo].key = key;
+        memo[nmemo].id  = id;
+        nmemo++;
+    }
+    return id;
+}
+
+static inline int __is_output_flag(const char* arg)
+{
+    return strcmp(arg, "-o") == 0 || strcmp(arg, "-MF") == 0;
+}
+
+static inline int __is_location_flag(const char* arg)
+{
+    return strcmp(arg, "-c") == 0 || strcmp(arg, "-MMD") == 0;
+}
+
+/**
+ * Hashes what determines the object of a compile job: the compiler and the
+ * command line without '-o <obj>', '-MF <dep>', '-c' and '-MMD'.
+ */
+static uint64_t __cache_argv_hash(char** argv)
+{
+    uint64_t h = __compiler_id(argv[0]);
+    for (char** a = argv + 1; *a; a++) LIKELY {
+        if (__is_output_flag(*a)) {
+            a += (a[1] != NULL);
+            continue;
+        }
+        if (__is_location_flag(*a)) {
+            continue;
+        }
+        h = __hash64(*a, strlen(*a) + 1, h);
+    }
+    return h;
+}
+
+/**
+ * Direct key of a job whose depfile has been loaded into 'job->deps'. The
+ * depfile lists no system headers, which only count through __system_id().
+ */
+static short __cache_direct_key(const __job_t* job, uint64_t* key)
+{
+    uint64_t h = __hash_str("direct", __cache_argv_hash(job->argv) ^ __system_id(job->argv));
+    uint64_t content = 0;
+
+    const char* p = job->deps.paths;
+    for (int k = 0; k < job->deps.count; k++, p += strlen(p) + 1) LIKELY {
+        if (__file_hash(p, &content) != 0) {
+            return -1;
+        }
+        h = __hash_str(p, h);
+        h = __hash64(&content, sizeof(content), h);
+    }
+
+    *key = h;
+    return 0;
+}
+
+/**
+ * Preprocessed key of a job: runs the job's command line with '-E' in place
+ * of '-c' and the output flags, and hashes what it prints.
+ */
+static short __cache_pp_key(const __job_t* job, uint64_t* key)
+{
+    char** argv = (char**) calloc(job->argc + 2, sizeof(char*));
+    if (!argv) UNLIKELY {
+        return -1;
+    }
+
+    int n = 0;
+    for (char** a = job->argv; *a; a++) LIKELY {
+        if (__is_output_flag(*a)) {
+            a += (a[1] != NULL);
+            continue;
+        }
+        if (!__is_location_flag(*a)) {
+            argv[n++] = *a;
+        }
+    }
+    argv[n++] = (char*) "-E";
+    argv[n]   = NULL;
+
+    size_t len = 0;
+    char* text = __run_output(argv, 1, &len);
+    free(argv);
+    if (!text) {
+        return -1;
+    }
+
+    *key = __hash64(text, len, __hash_str("preprocessed", __cache_argv_hash(job->argv)));
+    free(text);
+    return 0;
+}
+
+static void __cache_entry(uint64_t key, const char* ext, char* path, size_t capacity)
+{
+    snprintf(path, capacity, "%s/%02x/%016llx%s", __nob_cache.dir,
+             (unsigned) (key >> 56), (unsigned long long) key, ext);
+}
+
+static void __cache_mkdir(uint64_t key)
+{
+    char path[OUT_CAPACITY + 8];
+    snprintf(path, sizeof(path), "%s/%02x", __nob_cache.dir, (unsigned) (key >> 56));
+    mkdir(__nob_cache.dir, 0755);
+    mkdir(path, 0755);
+}
+
+/**
+ * Copies 'from' over 'to' with a hard link, falling back to a reflink
+ * (where supported) and then to a plain copy.
+ */
+static short __place(const char* from, const char* to)
+{
+    unlink(to);
+    if (link(from, to) == 0) LIKELY {
+        return 0;
+    }
+
+    int in  = open(from, O_RDONLY);
+    int out = (in >= 0) ? open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    short result = (in >= 0 && out >= 0) ? 0 : -1;
+
+#ifdef FICLONE
+    if (result == 0 && ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        close(out);
+        return 0;
+    }
+#endif
+
+    char buffer[1 << 16];
+    for (ssize_t r; result == 0 && (r = read(in, buffer, sizeof(buffer))) != 0;) {
+        if (r < 0) {
+            result = (errno == EINTR) ? 0 : -1;
+            continue;
+        }
+        for (ssize_t w = 0, n; result == 0 && w < r; w += (n > 0) ? n : 0) {
+            n = write(out, buffer + w, r - w);
+            result = (n < 0 && errno != EINTR) ? -1 : 0;
+        }
+    }
+
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0 && close(out) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(to);
+    }
+    return result;
+}
+
+/**
+ * Restores the object and depfile stored under 'key' into the job's output
+ * paths. Both get a fresh mtime, as if just compiled, which also marks the
+ * entry as recently used.
+ */
+static short __cache_get(uint64_t key, const __job_t* job)
+{
+    char obj[OUT_CAPACITY + 64], dep[OUT_CAPACITY + 64];
+    __cache_entry(key, ".o", obj, sizeof(obj));
+    __cache_entry(key, ".d", dep, sizeof(dep));
+
+    if (access(obj, F_OK) != 0 || access(dep, F_OK) != 0) {
+        return -1;
+    }
+
+    if (__place(obj, job->output) != 0 || __place(dep, job->depfile) != 0) UNLIKELY {
+        return -1;
+    }
+
+    utimensat(AT_FDCWD, job->output, NULL, 0);
+    utimensat(AT_FDCWD, job->depfile, NULL, 0);
+    utimensat(AT_FDCWD, obj, NULL, 0);
+    utimensat(AT_FDCWD, dep, NULL, 0);
+    return 0;
+}
+
+/**
+ * Stores the job's object and depfile under 'key'. Entries are staged under
+ * a temporary name and renamed, so concurrent builds never see half of one.
+ */
+static void __cache_put(uint64_t key, const __job_t* job)
+{
+    char path[OUT_CAPACITY + 64], tmp[OUT_CAPACITY + 96];
+
+    __cache_mkdir(key);
+
+    const char* exts[2] = { ".d", ".o" };   // The object last: it marks the entry.
+    const char* srcs[2] = { job->depfile, job->output };
+    for (int k = 0; k < 2; k++) {
+        __cache_entry(key, exts[k], path, sizeof(path));
+        snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+
+        if (__place(srcs[k], tmp) != 0 || rename(tmp, path) != 0) UNLIKELY {
+            unlink(tmp);
+            return;
+        }
+    }
+}
+
+/**
+ * Downloads the entry 'key' from the remote cache into the local one (via
+ * temporary names, like __cache_put()), then restores it like a local hit.
+ */
+static short __cache_remote_get(uint64_t key, const __job_t* job)
+{
+    char obj[OUT_CAPACITY + 64], dep[OUT_CAPACITY + 64];
+    char tobj[OUT_CAPACITY + 96], tdep[OUT_CAPACITY + 96];
+    char nobj[65], ndep[65];
+
+    __cache_mkdir(key);
+    __cache_entry(key, ".o", obj, sizeof(obj));
+    __cache_entry(key, ".d", dep, sizeof(dep));
+    snprintf(tobj, sizeof(tobj), "%s.%ld.tmp", obj, (long) getpid());
+    snprintf(tdep, sizeof(tdep), "%s.%ld.tmp", dep, (long) getpid());
+    __remote_name(key, ".o", nobj);
+    __remote_name(key, ".d", ndep);
+
+    const char* names[2] = { ndep, nobj };
+    const char* paths[2] = { tdep, tobj };
+    if (__nob_remote.backend.get(__nob_remote.backend.ctx, 2, names, paths) != 0 ||
+        rename(tdep, dep) != 0 || rename(tobj, obj) != 0) {
+        unlink(tdep);
+        unlink(tobj);
+        return -1;
+    }
+
+    return __cache_get(key, job);
+}
+
+/**
+ * Uploads the local entries of 'keys' from a separate process, so that the
+ * compile job it comes from finishes right away. The uploader holds the
+ * drain pipe until it is done.
+ */
+static void __cache_upload(const uint64_t* keys, int nkeys)
+{
+    if (!__nob_remote.enabled || nkeys <= 0 || nkeys > 2 || fork() != 0) {
+        return;
+    }
+
+    char names[4][65], paths[4][OUT_CAPACITY + 64];
+    const char* pnames[4];
+    const char* ppaths[4];
+    int n = 0;
+
+    for (int k = 0; k < nkeys; k++) {
+        const char* exts[2] = { ".d", ".o" };
+        for (int e = 0; e < 2; e++, n++) {
+            __remote_name(keys[k], exts[e], names[n]);
+            __cache_entry(keys[k], exts[e], paths[n], sizeof(paths[n]));
+            pnames[n] = names[n];
+            ppaths[n] = paths[n];
+        }
+    }
+
+    __nob_remote.backend.put(__nob_remote.backend.ctx, n, pnames, ppaths);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Looks the job up by its direct key. Runs in the scheduler, so a hit is
+ * served without spawning anything (but the first __system_id() probe of
+ * the build, which the compile children then inherit).
+ */
+static short __cache_lookup(__job_t* job)
+{
+    __system_id(job->argv);
+    __depfile_free(&job->deps);
+    if (__depfile_load(job->depfile, &job->deps) != 0) {
+        return -1;
+    }
+
+    uint64_t key = 0;
+    return (__cache_direct_key(job, &key) == 0) ? __cache_get(key, job) : -1;
+}
+
+/**
+ * Body of a cached compile, run in a forked child so that preprocessing
+ * overlaps with the rest of the pool: look the job up by its preprocessed
+ * key, locally and then remotely, or compile it, store the result under
+ * both keys and hand them to the remote cache.
+ * Returns the exit status for the child, __CACHE_RESTORED for a hit (a
+ * compiler exiting with that value is reported as EXIT_FAILURE).
+ */
+static int __cache_compile(__job_t* job)
+{
+    uint64_t keys[2];
+    int nkeys = 0;
+
+    uint64_t pp_key = 0;
+    const int token = job->__offloaded && __exec_pp_acquire();
+    const int cacheable = (__cache_pp_key(job, &pp_key) == 0);
+    __exec_pp_release(token);
+
+    if (cacheable && (__cache_get(pp_key, job) == 0 ||
+                      (__nob_remote.enabled && __cache_remote_get(pp_key, job) == 0))) {
+#ifdef DEBUG
+        printf("nobuild: '%s' restored from cache\n", job->output);
+#endif
+        return __CACHE_RESTORED;
+    }
+
+    const int status = job->__offloaded ? __exec_compile(job) : __job_exec(job);
+    if (status != 0) {
+        return (status == __CACHE_RESTORED) ? EXIT_FAILURE : status;
+    }
+
+    if (cacheable) {
+        __cache_put(pp_key, job);
+        keys[nkeys++] = pp_key;
+    }
+
+    uint64_t direct_key = 0;
+    __depfile_free(&job->deps);
+    if (__depfile_load(job->depfile, &job->deps) == 0 && __cache_direct_key(job, &direct_key) == 0) {
+        __cache_put(direct_key, job);
+        if (nkeys == 0 || direct_key != keys[0]) {
+            keys[nkeys++] = direct_key;
+        }
+    }
+
+    fflush(stdout);
+    __cache_upload(keys, nkeys);
+    return 0;
+}
+
+/**
+ * Body of a remote fetch, run in a forked child that takes no compile
+ * slot: try the direct key remotely. Only the network is waited on here;
+ * the preprocessed key needs the compiler, so it is left to the compile
+ * slot the job takes after a miss.
+ * Returns 0 if the object was restored, 1 if it has to be compiled.
+ */
+static int __cache_fetch(__job_t* job)
+{
+    uint64_t key = 0;
+
+    __depfile_free(&job->deps);
+    return (__depfile_load(job->depfile, &job->deps) == 0 && __cache_direct_key(job, &key) == 0 &&
+            __cache_remote_get(key, job) == 0) ? 0 : 1;
+}
+
+static pid_t __spawn_fetch(__job_t* job)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        int status = __cache_fetch(job);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    __nob_cache.stored = 1;
+    return pid;
+}
+
+static pid_t __spawn_cached(__job_t* job, int out)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        // The compiler inherits the helper's output.
+        if (out >= 0) {
+            dup2(out, STDOUT_FILENO);
+            dup2(out, STDERR_FILENO);
+        }
+        int status = __cache_compile(job);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    __nob_cache.stored = 1;
+    return pid;
+}
+
+typedef struct __cache_file {
+    long long mtime_ns;
+    long long size;
+    char path[OUT_CAPACITY + 64];
+} __cache_file_t;
+
+static int __cache_file_cmp(const void* a, const void* b)
+{
+    long long x = ((const __cache_file_t*) a)->mtime_ns;
+    long long y = ((const __cache_file_t*) b)->mtime_ns;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Evicts the least recently used entries once the cache outgrew its size
+ * limit, down to 90% of it. Only runs after builds that may have stored.
+ */
+static void __cache_trim(void)
+{
+    if (!__nob_cache.enabled || !__nob_cache.stored) {
+        return;
+    }
+    __nob_cache.stored = 0;
+
+    DIR* top = opendir(__nob_cache.dir);
+    if (!top) {
+        return;
+    }
+
+    __cache_file_t* files = NULL;
+    size_t nfiles = 0, capacity = 0;
+    long long total = 0;
+
+    for (struct dirent* e; (e = readdir(top)) != NULL;) {
+        if (strlen(e->d_name) != 2) {
+            continue;
+        }
+
+        char sub[OUT_CAPACITY + 8];
+        snprintf(sub, sizeof(sub), "%s/%.2s", __nob_cache.dir, e->d_name);
+        DIR* d = opendir(sub);
+        if (!d) {
+            continue;
+        }
+
+        for (struct dirent* f; (f = readdir(d)) != NULL;) {
+            if (f->d_name[0] == '.') {
+                continue;
+            }
+
+            if (nfiles == capacity) {
+                capacity = capacity ? 2 * capacity : 1024;
+                __cache_file_t* grown = (__cache_file_t*) realloc(files, capacity * sizeof(__cache_file_t));
+                if (!grown) UNLIKELY {
+                    break;
+                }
+                files = grown;
+            }
+
+            __cache_file_t* file = &files[nfiles];
+            struct stat st;
+            snprintf(file->path, sizeof(file->path), "%s/%.48s", sub, f->d_name);
+            if (stat(file->path, &st) == 0) {
+                file->mtime_ns = __MTIME_NS(st);
+                file->size     = (long long) st.st_size;
+                total += file->size;
+                nfiles++;
+            }
+        }
+        closedir(d);
+    }
+    closedir(top);
+
+    if (total > __nob_cache.max_size) {
+        qsort(files, nfiles, sizeof(__cache_file_t), __cache_file_cmp);
+
+        const long long target = __nob_cache.max_size / 10 * 9;
+        for (size_t k = 0; k < nfiles && total > target; k++) {
+            if (unlink(files[k].path) == 0) {
+                total -= files[k].size;
+            }
+        }
+    }
+    free(files);
+}
+
+
+
+/************************************************************
+ * Admission Control
+ ************************************************************/
+
+/*
+ * Besides the job limit, a compile or link only starts if the machine can
+ * take it: like `make -l`, nothing starts while the load average is above
+ * the limit, and a job whose expected peak RSS (recorded in the build
+ * database) does not fit in the memory budget next to the running jobs, or
+ * in the memory available right now, waits for a running job to finish.
+ * With nothing running a job is always admitted, so the build never
+ * stalls. Jobs without history are expected to use the mean of those with.
+ */
+static struct __admit {
+    double max_load;        /* Load average limit, <= 0 for none. */
+    long long budget;       /* As given to SET_MEMORY(). */
+    int configured;         /* SET_MEMORY() was called. */
+    long long limit;        /* Budget of this build in bytes, <= 0 for none. */
+    long long committed;    /* Expected peak RSS of the running jobs. */
+} __nob_admit = { 0.0, 0, 0, 0, 0 };
+
+void SET_LOAD(double max_load)
+{
+    __nob_admit.max_load = max_load;
+}
+
+void SET_MEMORY(long long budget)
+{
+    __nob_admit.budget     = budget;
+    __nob_admit.configured = 1;
+}
+
+/**
+ * Reads up to 'size' - 1 bytes of a (pseudo) file into 'buffer'.
+ * Returns the number of bytes read, or -1.
+ */
+static ssize_t __read_small(const char* path, char* buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = read(fd, buffer, size - 1);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+    buffer[(n > 0) ? n : 0] = '\0';
+    return n;
+}
+
+static double __loadavg(void)
+{
+    char buffer[128];
+    if (__read_small("/proc/loadavg", buffer, sizeof(buffer)) > 0) {
+        return strtod(buffer, NULL);
+    }
+    return -1.0;
+}
+
+/**
+ * Returns the bytes new jobs can use right now: the smaller of the system's
+ * MemAvailable and the room left in the cgroup v2 'memory.max', -1 if
+ * neither is known.
+ */
+static long long __mem_available(void)
+{
+    char buffer[4096];
+    long long available = -1;
+
+    if (__read_small("/proc/meminfo", buffer, sizeof(buffer)) > 0) {
+        const char* line = strstr(buffer, "MemAvailable:");
+        if (line) {
+            available = strtoll(line + sizeof("MemAvailable:") - 1, NULL, 10) * 1024;
+        }
+    }
+
+    // Under cgroup v2 the file holds a single "0::<path>" line.
+    if (__read_small("/proc/self/cgroup", buffer, sizeof(buffer)) > 3 && strncmp(buffer, "0::", 3) == 0) {
+        buffer[3 + strcspn(buffer + 3, "\n")] = '\0';
+
+        char path[sizeof("/sys/fs/cgroup/memory.current") + sizeof(buffer)], max[32], current[32];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", buffer + 3);
+        const int limited = (__read_small(path, max, sizeof(max)) > 0 && max[0] >= '0' && max[0] <= '9');
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.current", buffer + 3);
+
+        if (limited && __read_small(path, current, sizeof(current)) > 0) {
+            const long long room = strtoll(max, NULL, 10) - strtoll(current, NULL, 10);
+            if (available < 0 || room < available) {
+                available = (room > 0) ? room : 0;
+            }
+        }
+    }
+
+    return available;
+}
+
+/**
+ * Settles the limits of a build and the expected peak RSS of its jobs.
+ */
+static void __admit_open(__job_t* jobs, int njobs)
+{
+    if (__nob_admit.max_load <= 0) {
+        const char* env = getenv("NOB_LOAD");
+        if (env && env[0]) {
+            __nob_admit.max_load = strtod(env, NULL);
+        }
+    }
+
+    long long budget = __nob_admit.budget;
+    if (!__nob_admit.configured) {
+        const char* env = getenv("NOB_MEMORY");
+        if (env && env[0]) {
+            budget = (strcmp(env, "off") == 0) ? -1 : __parse_size(env);
+        }
+    }
+    if (budget == 0) {
+        const long long available = __mem_available();
+        budget = (available > 0) ? available / 10 * 9 : -1;
+    }
+    __nob_admit.limit     = budget;
+    __nob_admit.committed = 0;
+
+    long long known = 0;
+    int nknown = 0;
+    for (int j = 0; j < njobs; j++) {
+        const __db_record_t* record = __db_find(__db_key(jobs[j].output));
+        jobs[j].__rss = record ? (long long) record->max_rss_kb * 1024 : 0;
+        if (jobs[j].__rss > 0) {
+            known += jobs[j].__rss;
+            nknown++;
+        }
+    }
+    for (int j = 0; nknown > 0 && j < njobs; j++) {
+        if (jobs[j].__rss == 0) {
+            jobs[j].__rss = known / nknown;
+        }
+    }
+}
+
+/**
+ * Tells whether 'job' can start next to 'running' others.
+ */
+static int __admit(const __job_t* job, int running)
+{
+    if (running == 0) {
+        return 1;
+    }
+
+    if (__nob_admit.max_load > 0 && __loadavg() >= __nob_admit.max_load) {
+        return 0;
+    }
+
+    if (__nob_admit.limit > 0 && job->__rss > 0) {
+        if (__nob_admit.committed + job->__rss > __nob_admit.limit) {
+            return 0;
+        }
+        // Other processes may have taken memory since the build started.
+        const long long available = __mem_available();
+        if (available >= 0 && available < job->__rss) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/************************************************************
+ * Jobserver
+ ************************************************************/
+
+/*
+ * GNU make jobserver: a pipe or fifo holding one byte (a token) per job
+ * slot, besides the one slot every process implicitly owns. A job started
+ * next to running ones first takes a token, and the pool gives tokens back
+ * as soon as it holds more than its running jobs beyond the first. Tokens
+ * are read without blocking, from a descriptor of our own, so the file
+ * status flags make shares with its other children are left alone. While
+ * short of tokens, the pool waits on the jobserver along with its
+ * children (see __pool_wait()).
+ *
+ * Without a jobserver from a parent make, the pool serves one. It is a
+ * fifo, opened once for the pool and once more, blocking and inheritable,
+ * for the children, so each side has its own file description; its path
+ * is unlinked right away. The children find the latter pair in MAKEFLAGS
+ * as '-j<N> --jobserver-auth=R,W', the form every GNU make since 4.2
+ * understands.
+ */
+static struct __jobserver {
+    int enabled;            /* SET_JOBSERVER() value, -1 if never called. */
+    int rd, wr;             /* Token descriptors, -1 without a jobserver. */
+    int child[2];           /* Descriptors served to the children, -1 if none. */
+    char* makeflags;        /* MAKEFLAGS to restore, NULL if it was unset. */
+    char* held;             /* Tokens taken, to be given back as they were. */
+    int nheld;
+} __nob_jobserver = { -1, -1, -1, { -1, -1 }, NULL, NULL, 0 };
+
+void SET_JOBSERVER(int enabled)
+{
+    __nob_jobserver.enabled = (enabled != 0);
+}
+
+/**
+ * Finds the jobserver of a parent make in MAKEFLAGS. Returns 0 if one can
+ * be used, -1 otherwise.
+ */
+static short __jobserver_join(void)
+{
+    const char* flags = getenv("MAKEFLAGS");
+    const char* auth = NULL;
+    for (const char* p = flags; p && (p = strstr(p, "--jobserver-")) != NULL; p++) {
+        if (strncmp(p, "--jobserver-auth=", 17) == 0) {
+            auth = p + 17;
+        } else if (strncmp(p, "--jobserver-fds=", 16) == 0) {
+            auth = p + 16;
+        }
+    }
+    if (!auth) {
+        return -1;
+    }
+
+    char value[PATH_MAX];
+    snprintf(value, sizeof(value), "%.*s", (int) strcspn(auth, " "), auth);
+
+    if (strncmp(value, "fifo:", 5) == 0) {
+        __nob_jobserver.rd = open(value + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        __nob_jobserver.wr = (__nob_jobserver.rd >= 0) ? dup(__nob_jobserver.rd) : -1;
+    } else {
+        int rd = -1, wr = -1;
+        if (sscanf(value, "%d,%d", &rd, &wr) != 2 || fcntl(rd, F_GETFD) < 0 || fcntl(wr, F_GETFD) < 0) {
+            return -1; // Not passed down (the recipe lacks a '+').
+        }
+        // Reopening the pipe gives a file description of our own.
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", rd);
+        __nob_jobserver.rd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        __nob_jobserver.wr = (__nob_jobserver.rd >= 0) ? fcntl(wr, F_DUPFD_CLOEXEC, 0) : -1;
+    }
+
+    if (__nob_jobserver.wr < 0) {
+        if (__nob_jobserver.rd >= 0) {
+            close(__nob_jobserver.rd);
+        }
+        __nob_jobserver.rd = -1;
+        return -1;
+    }
+    fcntl(__nob_jobserver.wr, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/**
+ * Serves a jobserver with 'limit' - 1 tokens to the children.
+ */
+static short __jobserver_serve(int limit)
+{
+    const char* tmp = getenv("TMPDIR");
+    char dir[PATH_MAX], fifo[PATH_MAX + 8];
+    snprintf(dir, sizeof(dir), "%s/nobuild-XXXXXX", (tmp && tmp[0]) ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        return -1;
+    }
+    snprintf(fifo, sizeof(fifo), "%s/fifo", dir);
+
+    // The O_RDWR open comes first, so the others do not block.
+    int fds[4] = { -1, -1, -1, -1 };
+    if (mkfifo(fifo, 0600) == 0) LIKELY {
+        fds[0] = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        fds[1] = (fds[0] >= 0) ? fcntl(fds[0], F_DUPFD_CLOEXEC, 0) : -1;
+        fds[2] = (fds[1] >= 0) ? open(fifo, O_RDONLY) : -1;
+        fds[3] = (fds[2] >= 0) ? open(fifo, O_WRONLY) : -1;
+    }
+    unlink(fifo);
+    rmdir(dir);
+
+    if (fds[3] < 0) UNLIKELY {
+        for (int k = 0; k < 3; k++) {
+            if (fds[k] >= 0) {
+                close(fds[k]);
+            }
+        }
+        return -1;
+    }
+
+    __nob_jobserver.rd       = fds[0];
+    __nob_jobserver.wr       = fds[1];
+    __nob_jobserver.child[0] = fds[2];
+    __nob_jobserver.child[1] = fds[3];
+
+    for (int t = 1; t < limit; t++) {
+        while (write(__nob_jobserver.wr, "+", 1) < 0 && errno == EINTR) {}
+    }
+
+    const char* old = getenv("MAKEFLAGS");
+    __nob_jobserver.makeflags = old ? strdup(old) : NULL;
+
+    const size_t len = (old ? strlen(old) : 0) + 64;
+    char* flags = (char*) malloc(len);
+    if (flags) LIKELY {
+        snprintf(flags, len, "%s%s-j%d --jobserver-auth=%d,%d", old ? old : "", (old && old[0]) ? " " : "",
+                 limit, fds[2], fds[3]);
+        setenv("MAKEFLAGS", flags, 1);
+        free(flags);
+    }
+    return 0;
+}
+
+static void __jobserver_open(int limit)
+{
+    __nob_jobserver.nheld = 0;
+
+    if (__nob_jobserver.enabled < 0) {
+        const char* env = getenv("NOB_JOBSERVER");
+        __nob_jobserver.enabled = !(env && strcmp(env, "0") == 0);
+    }
+    if (!__nob_jobserver.enabled) {
+        return;
+    }
+
+    __nob_jobserver.held = (char*) malloc(limit);
+    if (!__nob_jobserver.held) UNLIKELY {
+        perror("malloc");
+        return;
+    }
+
+    if (__jobserver_join() != 0 && __jobserver_serve(limit) != 0) {
+        free(__nob_jobserver.held);
+        __nob_jobserver.held = NULL;
+    }
+}
+
+/**
+ * Takes a token if one is free. Returns 1 if it did, 0 otherwise.
+ */
+static int __jobserver_acquire(void)
+{
+    char token;
+    ssize_t n;
+    do {
+        n = read(__nob_jobserver.rd, &token, 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != 1) {
+        return 0;
+    }
+    __nob_jobserver.held[__nob_jobserver.nheld++] = token;
+    return 1;
+}
+
+/**
+ * Gives tokens back until at most 'busy' - 1 are held, 'busy' being the job
+ * slots in use.
+ */
+static void __jobserver_release(int busy)
+{
+    while (__nob_jobserver.nheld > 0 && __nob_jobserver.nheld >= busy) {
+        const char token = __nob_jobserver.held[--__nob_jobserver.nheld];
+        while (write(__nob_jobserver.wr, &token, 1) < 0 && errno == EINTR) {}
+    }
+}
+
+static void __jobserver_close(void)
+{
+    if (__nob_jobserver.rd < 0) {
+        return;
+    }
+
+    __jobserver_release(0);
+    close(__nob_jobserver.rd);
+    close(__nob_jobserver.wr);
+    __nob_jobserver.rd = __nob_jobserver.wr = -1;
+    free(__nob_jobserver.held);
+    __nob_jobserver.held = NULL;
+
+    if (__nob_jobserver.child[0] >= 0) {
+        close(__nob_jobserver.child[0]);
+        close(__nob_jobserver.child[1]);
+        __nob_jobserver.child[0] = __nob_jobserver.child[1] = -1;
+
+        if (__nob_jobserver.makeflags) {
+            setenv("MAKEFLAGS", __nob_jobserver.makeflags, 1);
+        } else {
+            unsetenv("MAKEFLAGS");
+        }
+        free(__nob_jobserver.makeflags);
+        __nob_jobserver.makeflags = NULL;
+    }
+}
+
+
+
+/************************************************************
+ * Tracing
+ ************************************************************/
+
+/*
+ * With tracing on, the pool appends one event per job outcome (run, remote
+ * fetch, offload declined by the executor, cache hit, up to date) to an
+ * array sized for the worst case
+ * before the build starts, so recording is a handful of stores and never
+ * allocates. After the build the events are written out in the Trace
+ * Event Format read by chrome://tracing and Perfetto, one track ("thread")
+ * per pool slot, and the slowest jobs are listed on stdout.
+ */
+#define __TRACE_TOP 10
+
+enum {
+    __TRACE_RUN,        /* Compiler or linker ran (a cache miss, if cached). */
+    __TRACE_FETCH,      /* Remote cache fetch, hit or miss. */
+    __TRACE_CACHED,     /* Restored from the local cache. */
+    __TRACE_UPTODATE,   /* Skipped. */
+    __TRACE_DECLINED    /* Turned down by the executor, then queued for a local slot. */
+};
+
+typedef struct __trace_event {
+    const __job_t* job;
+    int kind;
+    int tid;                /* Pool slot, 'nslots' for the scheduler itself. */
+    int ok;
+    long long start, end;   /* __now_us() values. */
+    long long queued;       /* Microseconds spent ready before 'start'. */
+    long long utime, stime; /* CPU time of the child, microseconds. */
+    long maxrss_kb;
+} __trace_event_t;
+
+static struct __trace {
+    char* path;             /* Trace file, NULL if tracing is off. */
+    int configured;
+    int limit;              /* Local job slots. */
+    int remote;             /* First executor slot. */
+    int nslots;             /* Local, fetch and executor slots. */
+    long long origin;       /* __now_us() when the build started. */
+    __trace_event_t* events;
+    int count;
+    int capacity;
+} __nob_trace = { NULL, 0, 0, 0, 0, 0, NULL, 0, 0 };
+
+void SET_TRACE(const char* path)
+{
+    free(__nob_trace.path);
+    __nob_trace.path       = (path && path[0]) ? strdup(path) : NULL;
+    __nob_trace.configured = 1;
+}
+
+static void __trace_open(int njobs, int limit, int remote, int nslots)
+{
+    if (!__nob_trace.configured) {
+        const char* env = getenv("NOB_TRACE");
+        SET_TRACE(env);
+    }
+    if (!__nob_trace.path) {
+        return;
+    }
+
+    // A job ends with at most one fetch, one declined offload and one
+    // other event.
+    __nob_trace.events = (__trace_event_t*) malloc((size_t) 3 * njobs * sizeof(__trace_event_t));
+    if (!__nob_trace.events) UNLIKELY {
+        perror("malloc");
+        return;
+    }
+    __nob_trace.count    = 0;
+    __nob_trace.capacity = 3 * njobs;
+    __nob_trace.limit  = limit;
+    __nob_trace.remote = remote;
+    __nob_trace.nslots = nslots;
+    __nob_trace.origin = __now_us();
+}
+
+/**
+ * Records that 'job' ended as 'kind' on slot 'tid', having started at
+ * 'start'. 'usage' is the child's rusage, NULL if nothing was spawned.
+ */
+static void __trace_add(const __job_t* job, int kind, int tid, long long start, int ok,
+                        const struct rusage* usage)
+{
+    if (__nob_trace.count == __nob_trace.capacity) UNLIKELY {
+        return;
+    }
+    __trace_event_t* event = &__nob_trace.events[__nob_trace.count++];
+    event->job       = job;
+    event->kind      = kind;
+    event->tid       = tid;
+    event->ok        = ok;
+    event->start     = start;
+    event->end       = __now_us();
+    event->queued    = (job->__ready > 0 && start > job->__ready) ? start - job->__ready : 0;
+    event->utime     = usage ? (long long) usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec : 0;
+    event->stime     = usage ? (long long) usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec : 0;
+    event->maxrss_kb = usage ? usage->ru_maxrss : 0;
+}
+
+/**
+ * Writes 'str' as a JSON string literal.
+ */
+static void __json_string(FILE* out, const char* str)
+{
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*) str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static int __trace_slower(const void* a, const void* b)
+{
+    const __trace_event_t* x = *(const __trace_event_t* const*) a;
+    const __trace_event_t* y = *(const __trace_event_t* const*) b;
+    const long long dx = x->end - x->start, dy = y->end - y->start;
+    return (dx < dy) - (dx > dy);
+}
+
+static void __trace_summary(void)
+{
+    __trace_event_t** runs = (__trace_event_t**) malloc((size_t) (__nob_trace.count + 1) * sizeof(__trace_event_t*));
+    if (!runs) UNLIKELY {
+        perror("malloc");
+        return;
+    }
+
+    int nruns = 0, kinds[5] = { 0, 0, 0, 0, 0 };
+    for (int e = 0; e < __nob_trace.count; e++) {
+        kinds[__nob_trace.events[e].kind]++;
+        if (__nob_trace.events[e].kind == __TRACE_RUN) {
+            runs[nruns++] = &__nob_trace.events[e];
+        }
+    }
+    qsort(runs, nruns, sizeof(__trace_event_t*), __trace_slower);
+
+    printf("nobuild: %.3fs, %d run, %d cached, %d up to date, %d fetched, %d declined; trace in '%s'\n",
+           (__now_us() - __nob_trace.origin) / 1e6, kinds[__TRACE_RUN], kinds[__TRACE_CACHED],
+           kinds[__TRACE_UPTODATE], kinds[__TRACE_FETCH], kinds[__TRACE_DECLINED], __nob_trace.path);
+    for (int k = 0; k < nruns && k < __TRACE_TOP; k++) {
+        printf("nobuild: %9.3fs %8ld KiB  %s\n", (runs[k]->end - runs[k]->start) / 1e6,
+               runs[k]->maxrss_kb, runs[k]->job->output);
+    }
+    free(runs);
+}
+
+static void __trace_close(void)
+{
+    if (!__nob_trace.events) {
+        return;
+    }
+
+    static const char* const names[] = { "run", "fetch", "cached", "up to date", "declined" };
+
+    FILE* out = fopen(__nob_trace.path, "w");
+    if (!out) UNLIKELY {
+        perror("fopen");
+    } else {
+        fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (int t = 0; t <= __nob_trace.nslots; t++) {
+            char name[32];
+            if (t == __nob_trace.nslots) {
+                snprintf(name, sizeof(name), "scheduler");
+            } else if (t < __nob_trace.limit) {
+                snprintf(name, sizeof(name), "job %d", t);
+            } else if (t >= __nob_trace.remote) {
+                snprintf(name, sizeof(name), "remote %d", t - __nob_trace.remote);
+            } else {
+                snprintf(name, sizeof(name), "fetch %d", t - __nob_trace.limit);
+            }
+            fprintf(out, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                    t, name);
+        }
+
+        for (int e = 0; e < __nob_trace.count; e++) {
+            const __trace_event_t* event = &__nob_trace.events[e];
+            fprintf(out, "%s{\"ph\":\"X\",\"name\":", (e > 0) ? ",\n" : "");
+            __json_string(out, event->job->output);
+            fprintf(out, ",\"cat\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                         "\"args\":{\"outcome\":\"%s\",\"ok\":%s,\"queued_us\":%lld,"
+                         "\"user_us\":%lld,\"sys_us\":%lld,\"max_rss_kb\":%ld}}",
+                    event->job->depfile[0] ? "compile" : "link", event->tid,
+                    event->start - __nob_trace.origin, event->end - event->start,
+                    names[event->kind], event->ok ? "true" : "false", event->queued,
+                    event->utime, event->stime, event->maxrss_kb);
+        }
+        fprintf(out, "\n]}\n");
+
+        if (fclose(out) != 0) UNLIKELY {
+            perror("fclose");
+        }
+    }
+
+    __trace_summary();
+    free(__nob_trace.events);
+    __nob_trace.events = NULL;
+}
+
+
+
+/************************************************************
+ * Compilation Database
+ ************************************************************/
+
+/*
+ * The compilation database is derived from the planned jobs: an entry for
+ * every source a job's inputs list, with the job's own argv minus the other
+ * sources. A first walk only hashes the entries (directory, file names and
+ * command hashes), so when the hash matches the one recorded in the build
+ * database the file is left alone without formatting anything; otherwise a
+ * second walk streams the JSON into memory, escaping every string once.
+ */
+#define __COMPDB_DEFAULT "compile_commands.json"
+
+static struct __compdb {
+    char path[OUT_CAPACITY];
+    int configured;
+    int disabled;
+} __nob_compdb;
+
+void SET_COMPDB(const char* path)
+{
+    __nob_compdb.configured = 1;
+    __nob_compdb.disabled   = (path == NULL || path[0] == '\0');
+    if (!__nob_compdb.disabled) {
+        strncpy(__nob_compdb.path, path, OUT_CAPACITY - 1);
+    }
+}
+
+static int __compdb_source(const char* path)
+{
+    static const char* const exts[] = { ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", ".m", ".mm" };
+    const char* dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return 0;
+    }
+    for (size_t e = 0; e < sizeof(exts) / sizeof(exts[0]); e++) {
+        if (strcmp(dot, exts[e]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Walks the entries of 'jobs', writing them to 'out' unless it is NULL, and
+ * returns a hash of them all. 'at' has room for the largest argc: it maps
+ * every argv entry to the input it holds, -1 for the others. 'pos' has
+ * room for the largest ninputs and maps the other way. Inputs share their
+ * strings with argv, and appear in it in the same order.
+ */
+static uint64_t __compdb_walk(const __job_t* jobs, int njobs, const char* dir, int* at, int* pos, FILE* out)
+{
+    uint64_t hash = __hash_str(dir, 0);
+    int count = 0;
+
+    for (int j = 0; j < njobs; j++) {
+        const __job_t* job = &jobs[j];
+        int primary = -1;
+
+        for (int k = 0; k < job->argc; k++) {
+            at[k] = -1;
+        }
+        for (int i = 0, k = 0; i < job->ninputs; i++) {
+            pos[i] = -1;
+            if (!__compdb_source(job->inputs[i])) {
+                continue;
+            }
+            int found = k;
+            while (found < job->argc && job->argv[found] != job->inputs[i]) {
+                found++;
+            }
+            if (found < job->argc) {
+                at[found] = i;
+                pos[i] = found;
+                k = found + 1;
+                primary = (primary < 0) ? found : primary;
+            }
+        }
+
+        // Sources missing from argv are members of a unity batch.
+        for (int i = 0; primary >= 0 && i < job->ninputs; i++) {
+            const char* file = job->inputs[i];
+            if (!__compdb_source(file)) {
+                continue;
+            }
+            hash = __hash_str(file, hash ^ job->cmd_hash);
+            if (!out) {
+                continue;
+            }
+            const int self = (pos[i] >= 0) ? pos[i] : primary;
+
+            fprintf(out, "%s  {\n    \"directory\": ", (count++ > 0) ? ",\n" : "");
+            __json_string(out, dir);
+            fprintf(out, ",\n    \"file\": ");
+            __json_string(out, file);
+            fprintf(out, ",\n    \"output\": ");
+            __json_string(out, job->output);
+            fprintf(out, ",\n    \"arguments\": [");
+            for (int k = 0, n = 0; k < job->argc; k++) {
+                if (k != self && at[k] >= 0) {
+                    continue;
+                }
+                fputs((n++ > 0) ? ", " : "", out);
+                __json_string(out, (k == self) ? file : job->argv[k]);
+            }
+            fprintf(out, "]\n  }");
+        }
+    }
+    return hash;
+}
+
+/**
+ * Writes the compilation database of 'jobs' unless the one on disk already
+ * describes them. Needs the build database to be open.
+ */
+static void __compdb_write(const __job_t* jobs, int njobs)
+{
+    if (!__nob_compdb.configured) {
+        const char* env = getenv("NOB_COMPDB");
+        SET_COMPDB(env ? env : __COMPDB_DEFAULT);
+    }
+    if (__nob_compdb.disabled) {
+        return;
+    }
+
+    char dir[PATH_MAX];
+    int argc = 0, ninputs = 0;
+    for (int j = 0; j < njobs; j++) {
+        argc    = (jobs[j].argc > argc) ? jobs[j].argc : argc;
+        ninputs = (jobs[j].ninputs > ninputs) ? jobs[j].ninputs : ninputs;
+    }
+    int* at = (int*) malloc((argc + ninputs + 1) * sizeof(int));
+    int* pos = at ? at + argc : NULL;
+    if (!at || !getcwd(dir, sizeof(dir))) UNLIKELY {
+        perror(at ? "getcwd" : "malloc");
+        free(at);
+        return;
+    }
+
+    const uint64_t key  = __db_key(__nob_compdb.path);
+    const uint64_t hash = __compdb_walk(jobs, njobs, dir, at, pos, NULL);
+    const __db_record_t* record = __db_find(key);
+    if (record && record->cmd_hash == hash && access(__nob_compdb.path, F_OK) == 0) LIKELY {
+        free(at);
+        return;
+    }
+
+    char* data  = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&data, &size);
+    if (!out) UNLIKELY {
+        perror("open_memstream");
+        free(at);
+        return;
+    }
+    fprintf(out, "[\n");
+    __compdb_walk(jobs, njobs, dir, at, pos, out);
+    fprintf(out, "\n]\n");
+
+    if (fclose(out) == 0 && __write_if_changed(__nob_compdb.path, data, size) == 0) LIKELY {
+        __db_record_t* updated = __db_upsert(key);
+        if (updated) {
+            updated->cmd_hash = hash;
+            __nob_db.dirty    = 1;
+        }
+    }
+    free(data);
+    free(at);
+}
+
+
+
+/************************************************************
+ * Scheduler
+ ************************************************************/
+
+/*
+ * Ready jobs are started longest remaining path first (HLFET): a job's
+ * priority is its own expected duration plus the largest priority among
+ * its successors, so the chain that bounds the build's wall time is never
+ * left waiting behind short, independent jobs. Durations come from the
+ * build database; jobs without history are estimated from the size of
+ * their main input, at the microseconds-per-byte rate observed on the jobs
+ * that have history (or a default one).
+ */
+#define __US_PER_BYTE_DEFAULT 10.0
+
+static void __job_priorities(__job_t* jobs, int njobs)
+{
+    long long known_us = 0, known_bytes = 0;
+    for (int j = 0; j < njobs; j++) {
+        const __db_record_t* record = __db_find(__db_key(jobs[j].output));
+        struct stat st;
+
+        jobs[j].__bytes = (!jobs[j].__done && jobs[j].ninputs > 0 && stat(jobs[j].inputs[0], &st) == 0) ? (long long) st.st_size : 0;
+        jobs[j].__priority = (record && record->duration_us > 0) ? (long long) record->duration_us : -1;
+        if (jobs[j].__priority > 0 && jobs[j].depfile[0]) {
+            known_us    += jobs[j].__priority;
+            known_bytes += jobs[j].__bytes;
+        }
+    }
+    const double rate = (known_bytes > 0) ? (double) known_us / known_bytes : __US_PER_BYTE_DEFAULT;
+
+    // Successors always come later in 'jobs' (rules are planned in
+    // topological order, a rule's link after its compiles), so one
+    // backwards sweep sees every successor's final priority.
+    for (int j = njobs - 1; j >= 0; j--) {
+        __job_t* job = &jobs[j];
+        if (job->__priority < 0) {
+            job->__priority = job->depfile[0] ? (long long) (rate * job->__bytes) : 0;
+        }
+
+        long long longest = 0;
+        for (int k = 0; k < job->__nsucc; k++) {
+            if (job->__succ[k]->__priority > longest) {
+                longest = job->__succ[k]->__priority;
+            }
+        }
+        job->__priority += longest;
+    }
+}
+
+/*
+ * Ready queue: a binary max-heap on '__priority'.
+ */
+typedef struct __ready {
+    __job_t** items;
+    int count;
+} __ready_t;
+
+static void __ready_push(__ready_t* ready, __job_t* job)
+{
+    if (__nob_trace.events && job->__ready == 0) {
+        job->__ready = __now_us();
+    }
+
+    int k = ready->count++;
+    while (k > 0) {
+        const int parent = (k - 1) / 2;
+        if (ready->items[parent]->__priority >= job->__priority) {
+            break;
+        }
+        ready->items[k] = ready->items[parent];
+        k = parent;
+    }
+    ready->items[k] = job;
+}
+
+static __job_t* __ready_pop(__ready_t* ready)
+{
+    __job_t* top  = ready->items[0];
+    __job_t* last = ready->items[--ready->count];
+
+    int k = 0;
+    for (;;) {
+        int child = 2 * k + 1;
+        if (child >= ready->count) {
+            break;
+        }
+        if (child + 1 < ready->count && ready->items[child + 1]->__priority > ready->items[child]->__priority) {
+            child++;
+        }
+        if (last->__priority >= ready->items[child]->__priority) {
+            break;
+        }
+        ready->items[k] = ready->items[child];
+        k = child;
+    }
+    if (ready->count > 0) {
+        ready->items[k] = last;
+    }
+    return top;
+}
+
+/**
+ * Marks a job as finished, queueing the successors it was the last
+ * prerequisite of.
+ */
+static void __job_release(__job_t* job, __ready_t* ready)
+{
+    job->__done = 1;
+    for (int k = 0; k < job->__nsucc; k++) {
+        if (--job->__succ[k]->__pending == 0) {
+            __ready_push(ready, job->__succ[k]);
+        }
+    }
+}
+
+/*
+ * Output and reaping. Compiles and links write their stdout and stderr to
+ * a pipe of their own, which the pool drains into a per-job buffer while
+ * they run; once a job ends the buffer is written to stderr in one go, so
+ * the diagnostics of parallel jobs never interleave and a slow terminal
+ * does not hold back the compilers. Jobs that succeed silently print
+ * nothing. Children are watched through pidfds (Linux 5.3+), so a single
+ * poll() waits for output, exits and jobserver tokens alike; without
+ * pidfds the pool checks for exited children every __WAIT_POLL_MS.
+ */
+#define __WAIT_POLL_MS 10
+
+static int __pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+/**
+ * Gives 'job' an output pipe, storing into '*out' the end for the child.
+ */
+static short __job_pipe(__job_t* job, int* out)
+{
+    int fds[2];
+    if (pipe(fds) != 0) UNLIKELY {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    job->__out_fd = fds[0];
+    job->__nlog   = 0;
+    *out = fds[1];
+    return 0;
+}
+
+/**
+ * Appends whatever the child wrote to the job's buffer, closing the pipe
+ * at end of file.
+ */
+static void __job_drain(__job_t* job)
+{
+    for (;;) {
+        if (job->__caplog - job->__nlog < 4096) {
+            const size_t capacity = job->__caplog ? 2 * job->__caplog : 8192;
+            char* log = (char*) realloc(job->__log, capacity);
+            if (!log) UNLIKELY {
+                perror("realloc");
+                break;
+            }
+            job->__log    = log;
+            job->__caplog = capacity;
+        }
+
+        ssize_t n = read(job->__out_fd, job->__log + job->__nlog, job->__caplog - job->__nlog);
+        if (n > 0) {
+            job->__nlog += n;
+        } else if (n == 0 || errno != EINTR) {
+            if (n == 0) {
+                close(job->__out_fd);
+                job->__out_fd = -1;
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Prints a finished job's output, and why it failed if it did.
+ */
+static void __job_flush(__job_t* job, int ok, int status)
+{
+    if (job->__out_fd >= 0) {
+        __job_drain(job);
+        if (job->__out_fd >= 0) {
+            close(job->__out_fd);
+            job->__out_fd = -1;
+        }
+    }
+
+    if (job->__nlog > 0) {
+        fflush(stdout);
+        __write_all(STDERR_FILENO, job->__log, job->__nlog);
+    }
+    if (!ok) {
+        if (WIFEXITED(status)) {
+            fprintf(stderr, "nobuild: '%s' failed with exit status %d\n", job->output, WEXITSTATUS(status));
+        } else {
+            fprintf(stderr, "nobuild: '%s' failed\n", job->output);
+        }
+    }
+
+    free(job->__log);
+    job->__log  = NULL;
+    job->__nlog = job->__caplog = 0;
+}
+
+/**
+ * Drops what a finished job printed, for an attempt that is run again.
+ */
+static void __job_discard(__job_t* job)
+{
+    if (job->__out_fd >= 0) {
+        close(job->__out_fd);
+        job->__out_fd = -1;
+    }
+
+    free(job->__log);
+    job->__log  = NULL;
+    job->__nlog = job->__caplog = 0;
+}
+
+/**
+ * Waits until a child in 'slots' is reaped, returning its slot with its
+ * status and rusage, or until output or (if 'starved') a jobserver token
+ * arrives, returning -1. Returns -2 if polling failed. 'fds' has room for
+ * 2 * 'nslots' + 1 entries.
+ */
+static int __pool_wait(__job_t** slots, int nslots, int starved, struct pollfd* fds, int* status,
+                       struct rusage* usage)
+{
+    int blind = 0;
+    for (int s = 0; s < nslots; s++) {
+        const __job_t* job = slots[s];
+        fds[2 * s].fd         = job ? job->__out_fd : -1;
+        fds[2 * s + 1].fd     = job ? job->__pidfd : -1;
+        fds[2 * s].events     = fds[2 * s + 1].events = POLLIN;
+        fds[2 * s].revents    = fds[2 * s + 1].revents = 0;
+        blind |= (job && job->__pidfd < 0);
+    }
+    fds[2 * nslots].fd      = (starved && __nob_jobserver.held) ? __nob_jobserver.rd : -1;
+    fds[2 * nslots].events  = POLLIN;
+    fds[2 * nslots].revents = 0;
+
+    if (poll(fds, 2 * nslots + 1, blind ? __WAIT_POLL_MS : -1) < 0 && errno != EINTR) UNLIKELY {
+        perror("poll");
+        return -2;
+    }
+
+    for (int s = 0; s < nslots; s++) {
+        __job_t* job = slots[s];
+        if (!job) {
+            continue;
+        }
+        if (fds[2 * s].revents) {
+            __job_drain(job);
+        }
+        if (job->__pidfd >= 0 && !fds[2 * s + 1].revents) {
+            continue;
+        }
+
+        pid_t pid = wait4(job->__pid, status, WNOHANG, usage);
+        if (pid == 0 || (pid < 0 && errno == EINTR)) {
+            continue;
+        }
+        if (pid < 0) UNLIKELY {
+            perror("wait4");
+            *status = -1;
+            memset(usage, 0, sizeof(*usage));
+        }
+        if (job->__pidfd >= 0) {
+            close(job->__pidfd);
+            job->__pidfd = -1;
+        }
+        return s;
+    }
+    return -1;
+}
+
+/**
+ * Runs a DAG of jobs keeping up to __jobs_limit() job slots busy, as far
+ * as __admit() and the jobserver let it; a multi-threaded link takes up
+ * several (see __link_slots()). Finished children are reaped by
+ * __pool_wait() and free slots are refilled right away. Jobs found up to
+ * date, or in the compilation cache, when they become ready are completed
+ * without spawning anything. With a remote
+ * cache, compile jobs first go through a fetch helper, which has slots of
+ * its own, and come back to the queue if it missed. With an executor (see
+ * SET_EXECUTOR()), compiles that find no local slot free run through it on
+ * slots of their own. Ready jobs are taken
+ * by priority (see __job_priorities()). After the first failure no new
+ * job is started, but running ones are still waited for.
+ * Returns 0 if every job succeeded, -1 otherwise.
+ */
+static short __pool_run(__job_t* jobs, int njobs)
+{
+    const int limit = __jobs_limit();
+    const int fetch_limit = (__nob_cache.enabled && __nob_remote.enabled) ? limit : 0;
+    const int exec_limit = __nob_exec.enabled ? __nob_exec.executor.slots : 0;
+    const int exec_first = limit + fetch_limit;
+    const int nslots = exec_first + exec_limit;
+
+    // A job is in the ready queue at most once at a time, so 'njobs'
+    // entries are enough. Slots [0, limit) hold local jobs,
+    // [limit, exec_first) remote fetches and [exec_first, nslots) the
+    // compiles handed to the executor.
+    __ready_t ready = { (__job_t**) calloc(njobs, sizeof(__job_t*)), 0 };
+    __job_t** slots = (__job_t**) calloc(nslots, sizeof(__job_t*));
+    struct pollfd* fds = (struct pollfd*) calloc(2 * nslots + 1, sizeof(struct pollfd));
+    if (!ready.items || !slots || !fds) UNLIKELY {
+        perror("calloc");
+        free(ready.items);
+        free(slots);
+        free(fds);
+        return -1;
+    }
+
+    __job_priorities(jobs, njobs);
+    __admit_open(jobs, njobs);
+    __jobserver_open(limit);
+    __trace_open(njobs, limit, exec_first, nslots);
+    if (exec_limit > 0) {
+        __exec_pp_open(limit);
+    }
+
+    int running = 0, busy = 0, fetching = 0, offloaded = 0, done = 0, failed = 0;
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].__done) {
+            done++; // Left clean by a previous WATCH() round.
+        } else if (jobs[j].__pending == 0) {
+            __ready_push(&ready, &jobs[j]);
+        }
+    }
+
+    for (;;) {
+        int starved = 0;
+        while (!failed && ready.count > 0) LIKELY {
+            __job_t* job = ready.items[0];
+
+            if (!job->__checked) {
+                job->__checked = 1;
+                const long long checking = __nob_trace.events ? __now_us() : 0;
+
+                int uptodate = (__nob_check == CHECK_HASH && __nob_db.table)
+                             ? __job_uptodate_hash(job)
+                             : __job_uptodate(job);
+                if (uptodate) {
+#ifdef DEBUG
+                    printf("nobuild: '%s' is up to date\n", job->output);
+#endif
+                    if (__nob_trace.events) {
+                        __trace_add(job, __TRACE_UPTODATE, nslots, checking, 1, NULL);
+                    }
+                    if (job->__toc && access(job->__toc, F_OK) != 0) {
+                        __toc_write(job);
+                    }
+                    __ready_pop(&ready);
+                    done++;
+                    __job_release(job, &ready);
+                    continue;
+                }
+
+                if (__nob_cache.enabled && job->depfile[0] && __cache_lookup(job) == 0) {
+#ifdef DEBUG
+                    printf("nobuild: '%s' restored from cache\n", job->output);
+#endif
+                    if (__nob_trace.events) {
+                        __trace_add(job, __TRACE_CACHED, nslots, checking, 1, NULL);
+                    }
+                    __ready_pop(&ready);
+                    done++;
+                    __job_record(job, 0);
+                    __job_release(job, &ready);
+                    continue;
+                }
+            }
+
+            // A multi-threaded link waits for the slots its threads take up.
+            // A compile with no room locally goes to the executor instead.
+            const int fetch = (fetch_limit > 0 && job->depfile[0] && !job->__fetched);
+            const int width = (job->__slots < limit) ? job->__slots : limit;
+            int offload = 0;
+            if (fetch) {
+                if (fetching == fetch_limit) {
+                    break;
+                }
+            } else if ((running > 0 && busy + width > limit) || !__admit(job, running)) {
+                offload = 1;
+            } else if (__nob_jobserver.held) {
+                while (__nob_jobserver.nheld < busy + width - 1 && __jobserver_acquire()) {}
+                if (running > 0 && __nob_jobserver.nheld < busy + width - 1) {
+                    starved = 1;
+                    offload = 1;
+                }
+            }
+            if (offload && (!job->__offload || job->__declined || offloaded == exec_limit)) {
+                break;
+            }
+            __ready_pop(&ready);
+
+            // Compilers may rewrite an existing output in place, which must
+            // never happen to a file hard-linked from the cache, and ar
+            // would keep the members of an old archive.
+            if ((job->depfile[0] || job->__clean) && !fetch) {
+                unlink(job->output);
+                if (job->depfile[0]) {
+                    unlink(job->depfile);
+                }
+            }
+
+            int out = -1;
+            if (!fetch && __job_pipe(job, &out) != 0) UNLIKELY {
+                failed = 1;
+                break;
+            }
+
+            job->__start      = __now_us();
+            job->__offloaded = offload;
+            if (fetch) {
+                job->__pid = __spawn_fetch(job);
+            } else if (__nob_cache.enabled && job->depfile[0]) {
+                job->__pid = __spawn_cached(job, out);
+            } else if (offload) {
+                job->__pid = __spawn_offload(job, out);
+            } else {
+                job->__pid = __spawn_job(job, out);
+            }
+            if (out >= 0) {
+                close(out);
+            }
+
+            if (job->__pid < 0) UNLIKELY {
+                job->__pid = 0;
+                __job_flush(job, 1, 0);
+                failed = 1;
+                break;
+            }
+            job->__pidfd = __pidfd_open(job->__pid);
+
+            for (int s = offload ? exec_first : fetch ? limit : 0; s < nslots; s++) {
+                if (!slots[s]) {
+                    slots[s] = job;
+                    break;
+                }
+            }
+            if (fetch) {
+                fetching++;
+            } else if (offload) {
+                offloaded++;
+            } else {
+                running++;
+                busy += width;
+                job->__slots = width;
+                __nob_admit.committed += job->__rss;
+            }
+        }
+
+        if (running + fetching + offloaded == 0) {
+            break;
+        }
+
+        int status = 0;
+        struct rusage usage;
+        const int slot = __pool_wait(slots, nslots, starved, fds, &status, &usage);
+        if (slot == -1) {
+            continue; // Output, or a jobserver token may be free.
+        }
+        if (slot < 0) UNLIKELY {
+            failed = 1;
+            break;
+        }
+
+        __job_t* job = slots[slot];
+        slots[slot] = NULL;
+        job->__pid  = 0;
+        const int fetched  = (slot >= limit && slot < exec_first);
+        const int exited   = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        const int declined = job->__offloaded && exited == __EXEC_DECLINED;
+        // Only a cache helper (see __spawn_cached()) exits with
+        // __CACHE_RESTORED, when it found the object by its preprocessed key.
+        const int restored = !fetched && __nob_cache.enabled && job->depfile[0] && exited == __CACHE_RESTORED;
+        const int ok = (exited == 0) || restored;
+        if (__nob_trace.events) {
+            const int kind = fetched  ? __TRACE_FETCH
+                           : declined ? __TRACE_DECLINED
+                           : restored ? __TRACE_CACHED : __TRACE_RUN;
+            __trace_add(job, kind, slot, job->__start, ok || declined, &usage);
+        }
+
+        if (fetched) {
+            fetching--;
+            if (ok) {
+#ifdef DEBUG
+                printf("nobuild: '%s' restored from cache\n", job->output);
+#endif
+                done++;
+                __job_record(job, 0);
+                __job_release(job, &ready);
+            } else {
+                job->__fetched = 1;
+                job->__ready   = 0;
+                __ready_push(&ready, job);
+            }
+            continue;
+        }
+
+        if (declined) {
+            // Turned down: the job waits for a local slot like any other,
+            // and the local compile prints the diagnostics again.
+            offloaded--;
+            job->__offloaded = 0;
+            job->__declined  = 1;
+            job->__ready     = 0;
+            __job_discard(job);
+            __ready_push(&ready, job);
+            continue;
+        }
+        if (job->__offloaded) {
+            offloaded--;
+            job->__offloaded = 0;
+            __job_flush(job, ok, status);
+            job->__maxrss_kb = 0; // The compiler ran elsewhere.
+        } else {
+            running--;
+            busy -= job->__slots;
+            __nob_admit.committed -= job->__rss;
+            __job_flush(job, ok, status);
+            if (__nob_jobserver.held) {
+                __jobserver_release(busy);
+            }
+            // Includes the children the cache helper waited for.
+            job->__maxrss_kb = usage.ru_maxrss;
+        }
+
+        if (!ok) {
+            failed = 1;
+            continue;
+        }
+
+        __rsp_remove(job);
+        if (job->__toc && __toc_write(job) != 0) UNLIKELY {
+            failed = 1;
+            continue;
+        }
+        // A cache hit says nothing about the compiler's time or memory.
+        done++;
+        __job_record(job, !restored);
+        __job_release(job, &ready);
+    }
+
+    __jobserver_close();
+    __exec_pp_close();
+    __trace_close();
+    free(fds);
+    free(slots);
+    free(ready.items);
+    return (!failed && done == njobs) ? 0 : -1;
+}
+
+
+/**
+ * Runs planned jobs and persists what the build learned.
+ */
+static short __build_jobs(__job_t* jobs, int njobs)
+{
+    __remote_open();
+    __exec_open();
+    const short result = __pool_run(jobs, njobs);
+    __db_save();
+    __remote_drain();
+    __cache_trim();
+    return result;
+}
+
+
+
+/************************************************************
+ * Watch Mode
+ ************************************************************/
+
+/*
+ * WATCH() keeps the planned jobs after the first build and subscribes,
+ * through inotify, to the directory of every job input and of every header
+ * listed by a depfile: editors often save by renaming a new file over the
+ * old one, which a watch on the file itself would not survive. Each
+ * directory is added once. Events are looked up by watch descriptor and
+ * file name in a sorted table of (key, job) pairs, so a save costs one
+ * binary search, and mark the jobs reading the file dirty. Once no event
+ * came for __WATCH_DEBOUNCE_MS, the dirty jobs, those downstream of them
+ * and those that failed or never ran last round go through the pool again,
+ * which still checks each of them; every other job is skipped without so
+ * much as a stat(). Outputs of jobs are not looked up, the DAG already
+ * orders their consumers.
+ */
+#define __WATCH_DEBOUNCE_MS 50
+#define __WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+typedef struct __watch_entry {
+    uint64_t key;           /* __hash_str(<file name>, <watch descriptor>). */
+    int job;
+} __watch_entry_t;
+
+typedef struct __watch {
+    int fd;                 /* inotify instance. */
+    uint64_t* dirs;         /* Open-addressing table of directory hashes, 0 if free, */
+    int* wds;               /* and their watch descriptors (-1 if not watchable). */
+    uint32_t capdirs, ndirs;
+    __watch_entry_t* entries;
+    size_t count, capacity;
+    uint64_t* outputs;      /* Sorted hashes of the jobs' outputs. */
+    int noutputs;
+} __watch_t;
+
+#ifdef __linux__
+static int __watch_cmp_u64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static int __watch_cmp_entry(const void* a, const void* b)
+{
+    return __watch_cmp_u64(&((const __watch_entry_t*) a)->key, &((const __watch_entry_t*) b)->key);
+}
+
+/**
+ * Returns the watch descriptor of the first 'len' bytes of 'path' ("." if
+ * empty), adding the watch the first time the directory is seen.
+ */
+static int __watch_dir(__watch_t* w, const char* path, size_t len)
+{
+    if (4 * (w->ndirs + 1) > 3 * w->capdirs) UNLIKELY {
+        const uint32_t capacity = w->capdirs ? 2 * w->capdirs : 1024;
+        uint64_t* dirs = (uint64_t*) calloc(capacity, sizeof(uint64_t));
+        int* wds = (int*) malloc(capacity * sizeof(int));
+        if (!dirs || !wds) UNLIKELY {
+            perror("calloc");
+            free(dirs);
+            free(wds);
+            return -1;
+        }
+        for (uint32_t d = 0; d < w->capdirs; d++) {
+            if (w->dirs[d]) {
+                uint32_t i = (uint32_t) w->dirs[d] & (capacity - 1);
+                while (dirs[i]) {
+                    i = (i + 1) & (capacity - 1);
+                }
+                dirs[i] = w->dirs[d];
+                wds[i]  = w->wds[d];
+            }
+        }
+        free(w->dirs);
+        free(w->wds);
+        w->dirs    = dirs;
+        w->wds     = wds;
+        w->capdirs = capacity;
+    }
+
+    uint64_t hash = __hash64(path, len, 0);
+    hash = hash ? hash : 1;
+
+    const uint32_t mask = w->capdirs - 1;
+    uint32_t i = (uint32_t) hash & mask;
+    for (; w->dirs[i]; i = (i + 1) & mask) LIKELY {
+        if (w->dirs[i] == hash) {
+            return w->wds[i];
+        }
+    }
+
+    char dir[PATH_MAX];
+    if (len == 0) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int) len, path);
+    }
+
+    w->dirs[i] = hash;
+    w->wds[i]  = inotify_add_watch(w->fd, dir, __WATCH_EVENTS | IN_ONLYDIR);
+    w->ndirs++;
+    return w->wds[i];
+}
+
+static short __watch_add(__watch_t* w, const char* path, int job)
+{
+    const uint64_t hash = __hash_str(path, 0);
+    if (bsearch(&hash, w->outputs, w->noutputs, sizeof(uint64_t), __watch_cmp_u64)) {
+        return 0;
+    }
+
+    const char* slash = strrchr(path, '/');
+    const int wd = __watch_dir(w, path, slash ? (size_t) (slash - path) : 0);
+    if (wd < 0) {
+        return 0; // The directory is gone, the build will tell.
+    }
+
+    if (w->count == w->capacity) {
+        const size_t capacity = w->capacity ? 2 * w->capacity : 4096;
+        __watch_entry_t* entries = (__watch_entry_t*) realloc(w->entries, capacity * sizeof(__watch_entry_t));
+        if (!entries) UNLIKELY {
+            perror("realloc");
+            return -1;
+        }
+        w->entries  = entries;
+        w->capacity = capacity;
+    }
+
+    w->entries[w->count].key = __hash_str(slash ? slash + 1 : path, (uint64_t) wd);
+    w->entries[w->count].job = job;
+    w->count++;
+    return 0;
+}
+
+static short __watch_outputs(__watch_t* w, const __job_t* jobs, int njobs)
+{
+    w->outputs = (uint64_t*) malloc((2 * njobs + 1) * sizeof(uint64_t));
+    if (!w->outputs) UNLIKELY {
+        perror("malloc");
+        return -1;
+    }
+    for (int j = 0; j < njobs; j++) {
+        w->outputs[w->noutputs++] = __hash_str(jobs[j].output, 0);
+        if (jobs[j].__toc) {
+            w->outputs[w->noutputs++] = __hash_str(jobs[j].__toc, 0);
+        }
+    }
+    qsort(w->outputs, w->noutputs, sizeof(uint64_t), __watch_cmp_u64);
+    return 0;
+}
+
+/**
+ * Rebuilds the lookup table from the inputs and depfiles of every job.
+ */
+static short __watch_index(__watch_t* w, __job_t* jobs, int njobs)
+{
+    w->count = 0;
+    for (int j = 0; j < njobs; j++) {
+        __job_t* job = &jobs[j];
+        for (int i = 0; i < job->ninputs; i++) {
+            if (__watch_add(w, job->inputs[i], j) != 0) UNLIKELY {
+                return -1;
+            }
+        }
+
+        if (job->depfile[0] && !job->deps.paths) {
+            __depfile_load(job->depfile, &job->deps);
+        }
+        const char* dep = job->deps.paths;
+        for (int d = 0; d < job->deps.count; d++, dep += strlen(dep) + 1) {
+            if (__watch_add(w, dep, j) != 0) UNLIKELY {
+                return -1;
+            }
+        }
+    }
+
+    qsort(w->entries, w->count, sizeof(__watch_entry_t), __watch_cmp_entry);
+    return 0;
+}
+
+/**
+ * Marks dirty the jobs reading the files named by a buffer of events.
+ * Returns how many were marked.
+ */
+static int __watch_mark(__watch_t* w, __job_t* jobs, int njobs, const char* buffer, size_t size)
+{
+    int marked = 0;
+    for (size_t at = 0; at < size;) {
+        const struct inotify_event* event = (const struct inotify_event*) (buffer + at);
+        at += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) UNLIKELY {
+            for (int j = 0; j < njobs; j++) {
+                jobs[j].__done = 0;
+            }
+            marked += njobs;
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            // The directory went away: forget every watch, the next
+            // __watch_index() adds back those still needed.
+            memset(w->dirs, 0, w->capdirs * sizeof(uint64_t));
+            w->ndirs = 0;
+            continue;
+        }
+        if (event->len == 0) {
+            continue;
+        }
+
+        const uint64_t key = __hash_str(event->name, (uint64_t) event->wd);
+        size_t lo = 0, hi = w->count;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (w->entries[mid].key < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < w->count && w->entries[lo].key == key; lo++) {
+            jobs[w->entries[lo].job].__done = 0;
+            marked++;
+        }
+    }
+    return marked;
+}
+
+/**
+ * Waits until a change made some job dirty and no event came since for
+ * __WATCH_DEBOUNCE_MS. Returns -1 on failure.
+ */
+static short __watch_wait(__watch_t* w, __job_t* jobs, int njobs)
+{
+    // Large enough for any single event, aligned for reading them in place.
+    union {
+        struct inotify_event event;
+        char bytes[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    } buffer;
+
+    int marked = 0;
+    for (;;) {
+        struct pollfd pfd = { w->fd, POLLIN, 0 };
+        const int ready = poll(&pfd, 1, marked ? __WATCH_DEBOUNCE_MS : -1);
+        if (ready == 0) {
+            return 0;
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+
+        ssize_t n;
+        while ((n = read(w->fd, buffer.bytes, sizeof(buffer.bytes))) > 0) {
+            marked += __watch_mark(w, jobs, njobs, buffer.bytes, (size_t) n);
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) UNLIKELY {
+            perror("read");
+            return -1;
+        }
+    }
+}
+
+/**
+ * Makes every job downstream of a dirty one dirty as well, resets their
+ * per-run state and counts their dirty prerequisites. Returns the number
+ * of dirty jobs.
+ */
+static int __watch_cone(__job_t* jobs, int njobs)
+{
+    for (int j = 0; j < njobs; j++) {
+        jobs[j].__pending = 0;
+    }
+
+    // Successors always come later in 'jobs'.
+    int dirty = 0;
+    for (int j = 0; j < njobs; j++) {
+        __job_t* job = &jobs[j];
+        if (job->__done) {
+            continue;
+        }
+
+        dirty++;
+        job->__fetched  = 0;
+        job->__declined = 0;
+        job->__ready    = 0;
+        for (int k = 0; k < job->__nsucc; k++) {
+            job->__succ[k]->__done = 0;
+            job->__succ[k]->__pending++;
+        }
+    }
+    return dirty;
+}
+#endif
+
+/**
+ * Rebuilds the dirty parts of the graph whenever its files change, after a
+ * first build has run. Only returns if watching fails.
+ */
+static short __watch(__job_t* jobs, int njobs)
+{
+#ifdef __linux__
+    __watch_t w;
+    memset(&w, 0, sizeof(w));
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0) UNLIKELY {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    short result = __watch_outputs(&w, jobs, njobs);
+    while (result == 0) {
+        // Jobs checked last round may have written a new depfile.
+        for (int j = 0; j < njobs; j++) {
+            if (jobs[j].__checked) {
+                jobs[j].__checked = 0;
+                __depfile_free(&jobs[j].deps);
+            }
+        }
+
+        if (__watch_index(&w, jobs, njobs) != 0) UNLIKELY {
+            result = -1;
+            break;
+        }
+        printf("nobuild: watching %u directories for changes\n", w.ndirs);
+        fflush(stdout);
+        if (__watch_wait(&w, jobs, njobs) != 0) UNLIKELY {
+            result = -1;
+            break;
+        }
+
+        const long long start = __now_us();
+        const int dirty = __watch_cone(jobs, njobs);
+        const short built = __build_jobs(jobs, njobs);
+        printf("nobuild: %s, %d of %d jobs checked in %.3fs\n", (built == 0) ? "done" : "build failed",
+               dirty, njobs, (__now_us() - start) / 1e6);
+        fflush(stdout);
+    }
+
+    close(w.fd);
+    free(w.dirs);
+    free(w.wds);
+    free(w.entries);
+    free(w.outputs);
+    return result;
+#else
+    (void) jobs;
+    (void) njobs;
+    fprintf(stderr, "nobuild: WATCH() needs inotify\n");
+    return -1;
+#endif
+}
+
+
+
+/************************************************************
+ * Build
+ ************************************************************/
+
+/**
+ * Returns the extension of a source file name (e.g. ".c"), or NULL.
+ */
+static const char* __source_ext(const char* src)
+{
+    const char* slash = strrchr(src, '/');
+    const char* dot   = strrchr(src, '.');
+    return (dot && dot != src && (!slash || dot > slash + 1)) ? dot : NULL;
+}
+
+/**
+ * Derives the object file path of a source: the extension (if any) is
+ * replaced by ".o", e.g. "test/foo.c" -> "test/foo.o".
+ */
+static short __object_path(const char* src, char* dst, size_t capacity)
+{
+    const char* dot = __source_ext(src);
+    size_t stem = dot ? (size_t) (dot - src) : strlen(src);
+
+    if (stem + sizeof(".o") > capacity) UNLIKELY {
+        return -1;
+    }
+
+    memcpy(dst, src, stem);
+    memcpy(dst + stem, ".o", sizeof(".o"));
+    return 0;
+}
+
+static int __is_clang(const char* cmd)
+{
+    const char* base = strrchr(cmd, '/');
+    return strstr(base ? base + 1 : cmd, "clang") != NULL;
+}
+
+/**
+ * Allocates an argv starting with the rule's flag set (compiler and flags),
+ * followed for 'compile' jobs by the options loading the rule's PCH, with
+ * room for 'tail' more entries plus the terminating NULL. The number of
+ * entries already filled is stored in '*argc'.
+ */
+static char** __argv_prefix(build_rule_t* rule, int tail, int* argc, int compile)
+{
+    const __flag_set_t* set = rule->__flags;
+    const int pch = (compile && rule->pch) ? 2 : 0;
+    char** argv = (char**) __arena_alloc(&__nob_run, (set->argc + pch + tail + 1) * sizeof(char*));
+    if (!argv) UNLIKELY {
+        return NULL;
+    }
+
+    memcpy(argv, set->argv, set->argc * sizeof(char*));
+    *argc = set->argc;
+
+    if (pch) {
+        // gcc looks for '<header>.gch' when including '<header>', here the
+        // stub written by __pch_stub(), or the header itself.
+        const char* output = rule->pch->output;
+        const size_t len = strlen(output);
+        if (__is_clang(set->argv[0]) || len < 4 || strcmp(output + len - 4, ".gch") != 0) {
+            argv[(*argc)++] = (char*) "-include-pch";
+            argv[(*argc)++] = rule->pch->output;
+        } else {
+            char* header = (char*) __arena_alloc(&__nob_run, len - 3);
+            if (!header) UNLIKELY {
+                return NULL;
+            }
+            memcpy(header, output, len - 4);
+            header[len - 4] = '\0';
+            argv[(*argc)++] = (char*) "-include";
+            argv[(*argc)++] = header;
+        }
+    }
+
+    argv[*argc] = NULL;
+    return argv;
+}
+
+static char** __inputs_alloc(int n)
+{
+    return (char**) __arena_alloc(&__nob_run, n * sizeof(char*));
+}
+
+/**
+ * Number of argv entries __compile_options() adds for 'rule'.
+ */
+static int __compile_noptions(const build_rule_t* rule)
+{
+    return (rule->kind == RULE_SHARED_LIB) + (rule->cc->lto != LTO_NONE);
+}
+
+/**
+ * Appends the code generation options every compile of 'rule' needs:
+ * -fPIC for a shared library and the LTO mode. Returns the new count of
+ * entries.
+ */
+static int __compile_options(const build_rule_t* rule, char** argv, int argc)
+{
+    if (rule->kind == RULE_SHARED_LIB) {
+        argv[argc++] = (char*) "-fPIC";
+    }
+    if (rule->cc->lto == LTO_THIN && __is_clang(rule->cc->cmd)) {
+        argv[argc++] = (char*) "-flto=thin";
+    } else if (rule->cc->lto != LTO_NONE) {
+        argv[argc++] = (char*) "-flto";
+    }
+    return argc;
+}
+
+static int __ld_is(const compiler_t* cc, const char* name)
+{
+    return strcmp(cc->ld, name) == 0;
+}
+
+/**
+ * Job slots the link of 'rule' takes up: all of them when it runs on as
+ * many threads (a parallel linker, or partitioned LTO), 1 otherwise.
+ */
+static int __link_slots(const build_rule_t* rule)
+{
+    const compiler_t* cc = rule->cc;
+    if (rule->kind == RULE_STATIC_LIB) {
+        return 1;
+    }
+
+    const int partitioned = (cc->lto == LTO_THIN) || (cc->lto == LTO_FULL && !__is_clang(cc->cmd));
+    return (partitioned || __ld_is(cc, "mold") || __ld_is(cc, "lld")) ? __jobs_limit() : 1;
+}
+
+/**
+ * Number of argv entries __link_options() and __link_jobs() add for
+ * 'rule', at most.
+ */
+static int __link_noptions(const build_rule_t* rule)
+{
+    //      (-shared + -soname)                         + -fuse-ld + threads + LTO mode, jobs and cache
+    return ((rule->kind == RULE_SHARED_LIB) ? 2 : 0) + 1        + 1       + 3;
+}
+
+/**
+ * Concatenates 'a', 'b' and 'c' into the run's arena.
+ */
+static char* __link_option(const char* a, const char* b, const char* c)
+{
+    const size_t la = strlen(a), lb = strlen(b), lc = strlen(c);
+    char* option = (char*) __arena_alloc(&__nob_run, la + lb + lc + 1);
+    if (option) LIKELY {
+        memcpy(option, a, la);
+        memcpy(option + la, b, lb);
+        memcpy(option + la + lb, c, lc + 1);
+    }
+    return option;
+}
+
+/**
+ * Appends the options making a link produce what 'rule' asks for, i.e.
+ * `-shared -Wl,-soname,<name>` for a shared library, and those selecting
+ * its linker and LTO mode. Returns the new count of entries, or -1 on
+ * failure.
+ */
+static int __link_options(const build_rule_t* rule, char** argv, int argc)
+{
+    const compiler_t* cc = rule->cc;
+    const int first = argc;
+
+    if (rule->kind == RULE_SHARED_LIB) {
+        const char* slash = strrchr(rule->output, '/');
+        argv[argc++] = (char*) "-shared";
+        argv[argc++] = __link_option("-Wl,-soname,", slash ? slash + 1 : rule->output, "");
+    }
+
+    if (cc->ld[0]) {
+        argv[argc++] = __link_option("-fuse-ld=", cc->ld, "");
+    }
+
+    if (cc->lto == LTO_FULL || (cc->lto == LTO_THIN && !__is_clang(cc->cmd))) {
+        argv[argc++] = (char*) "-flto";
+    } else if (cc->lto == LTO_THIN) {
+        argv[argc++] = (char*) "-flto=thin";
+        if (__nob_cache.enabled) {
+            argv[argc++] = __link_option(__ld_is(cc, "lld") ? "-Wl,--thinlto-cache-dir=" : "-Wl,-plugin-opt,cache-dir=",
+                                         __nob_cache.dir, "/thinlto");
+        }
+    }
+
+    for (int i = first; i < argc; i++) {
+        if (!argv[i]) UNLIKELY {
+            return -1;
+        }
+    }
+    return argc;
+}
+
+/**
+ * Appends to the final job of 'rule' the options sizing linker threads and
+ * LTO partitions to the job slots (see __link_slots()). They come after
+ * the inputs, which the driver allows, and are left out of 'cmd_hash', so
+ * that a build with another -j does not relink everything.
+ */
+static short __link_jobs(const build_rule_t* rule, __job_t* link)
+{
+    const compiler_t* cc = rule->cc;
+    const int first = link->argc;
+    char jobs[16];
+    snprintf(jobs, sizeof(jobs), "%d", __jobs_limit());
+
+    if (__ld_is(cc, "mold")) {
+        link->argv[link->argc++] = __link_option("-Wl,--thread-count=", jobs, "");
+    } else if (__ld_is(cc, "lld")) {
+        link->argv[link->argc++] = __link_option("-Wl,--threads=", jobs, "");
+    }
+
+    if (cc->lto != LTO_NONE && !__is_clang(cc->cmd)) {
+        // gcc partitions the program and optimizes the partitions in parallel.
+        link->argv[link->argc++] = __link_option("-flto=", jobs, "");
+    } else if (cc->lto == LTO_THIN) {
+        link->argv[link->argc++] = __link_option("-flto-jobs=", jobs, "");
+    }
+    link->argv[link->argc] = NULL;
+    link->__sized = link->argc - first;
+
+    for (int i = first; i < link->argc; i++) {
+        if (!link->argv[i]) UNLIKELY {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sets up the interface file of a shared library's link (see __toc_write()).
+ */
+static short __link_toc(const build_rule_t* rule, __job_t* link)
+{
+    if (rule->kind != RULE_SHARED_LIB) {
+        return 0;
+    }
+
+    const size_t len = strlen(rule->output) + sizeof(".toc");
+    link->__toc = (char*) __arena_alloc(&__nob_run, len);
+    if (!link->__toc) UNLIKELY {
+        return -1;
+    }
+    snprintf(link->__toc, len, "%s.toc", rule->output);
+    return 0;
+}
+
+/**
+ * BUILD_MODE_SINGLE: a single job, `cc <flags> -o <output> <target> <deps>`.
+ * Room is left for 'extra' more inputs (outputs of required rules).
+ */
+static short __plan_single(build_rule_t* rule, __job_t* jobs, int nsrcs, int extra)
+{
+    __job_t* job = &jobs[0];
+
+    //       (compile options           + link options           + "-o" + output + target + deps + required outputs)
+    int tail = __compile_noptions(rule) + __link_noptions(rule) + 1    + 1      + nsrcs                 + extra;
+    int i = 0;
+    job->argv = __argv_prefix(rule, tail, &i, 1);
+    if (!job->argv) UNLIKELY {
+        return -1;
+    }
+
+    i = __compile_options(rule, job->argv, i);
+    job->__slots = __link_slots(rule);
+    if ((i = __link_options(rule, job->argv, i)) < 0 || __link_toc(rule, job) != 0) UNLIKELY {
+        return -1;
+    }
+    job->argv[i++] = (char*) "-o";
+    job->argv[i++] = rule->output;
+    job->argv[i++] = (char*) rule->target->name;
+    for (object_t* o = rule->dependencies; o; o = o->__next) LIKELY {
+        job->argv[i++] = (char*) o->name;
+    }
+    job->argv[i] = NULL; // execvp() needs NULL-terminated array
+    job->argc = i;
+
+    snprintf(job->output, sizeof(job->output), "%s", rule->output);
+
+    job->inputs = __inputs_alloc(nsrcs + extra + (rule->pch != NULL));
+    if (!job->inputs) UNLIKELY {
+        return -1;
+    }
+
+    job->inputs[job->ninputs++] = (char*) rule->target->name;
+    for (object_t* o = rule->dependencies; o; o = o->__next) LIKELY {
+        job->inputs[job->ninputs++] = (char*) o->name;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns what a file generated in 'dir' has to #include for 'src': the
+ * path itself if absolute, relative to 'dir' otherwise.
+ */
+static short __include_path(const char* dir, const char* src, char* dst, size_t capacity)
+{
+    size_t used = 0;
+    if (src[0] != '/') {
+        for (const char* p = dir; *p;) {
+            const size_t len = strcspn(p, "/");
+            if (len == 2 && p[0] == '.' && p[1] == '.') {
+                // Going up from 'dir' cannot be undone by "../".
+                return realpath(src, dst) ? 0 : -1;
+            }
+            if (len > 0 && !(len == 1 && p[0] == '.')) {
+                if (used + 3 >= capacity) {
+                    return -1;
+                }
+                memcpy(dst + used, "../", 3);
+                used += 3;
+            }
+            p += len + (p[len] == '/');
+        }
+    }
+    return (snprintf(dst + used, capacity - used, "%s", src) < (int) (capacity - used)) ? 0 : -1;
+}
+
+#define __PCH_STUB "/* Generated by nobuild: a precompiled header falls back to this. */\n"
+
+/**
+ * gcc only finds '<name>.gch' while including '<name>', from the directory
+ * the .gch is in. Unless the PCH is built next to its header, compiles
+ * include the stub '<pch minus .gch>' (see __argv_prefix()), which this
+ * writes to #include the real header: the compiler uses the PCH when it is
+ * valid, the header otherwise, and `cc -E` always preprocesses the header.
+ * A file other than a previous stub is never overwritten.
+ */
+static short __pch_stub(const build_rule_t* rule)
+{
+    const char* output = rule->output;
+    const size_t len = strlen(output);
+    if (__is_clang(rule->__flags->argv[0]) || len < 4 || strcmp(output + len - 4, ".gch") != 0) {
+        return 0;
+    }
+
+    char path[OUT_CAPACITY], dir[OUT_CAPACITY], include[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s", (int) (len - 4), output);
+    if (strcmp(path, rule->target->name) == 0) {
+        return 0;
+    }
+
+    const char* slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int) (slash - path) : 0, path);
+    if (__include_path(dir, rule->target->name, include, sizeof(include)) != 0) UNLIKELY {
+        fprintf(stderr, "nobuild: cannot include '%s' from '%s'\n", rule->target->name, path);
+        return -1;
+    }
+
+    char head[sizeof(__PCH_STUB)] = {0};
+    FILE* f = fopen(path, "r");
+    if (f) {
+        const size_t n = fread(head, 1, sizeof(head) - 1, f);
+        fclose(f);
+        if (n < sizeof(head) - 1 || memcmp(head, __PCH_STUB, n) != 0) {
+            fprintf(stderr, "nobuild: '%s' is in the way of the stub of '%s'\n", path, output);
+            return -1;
+        }
+    }
+
+    char text[sizeof(__PCH_STUB) + PATH_MAX + 16];
+    const int size = snprintf(text, sizeof(text), "%s#include \"%s\"\n", __PCH_STUB, include);
+    return __write_if_changed(path, text, (size_t) size);
+}
+
+/**
+ * BUILD_MODE_PCH: `cc <flags> -x <lang>-header -MMD -MF <pch>.d -o <pch> <header>`.
+ */
+static short __plan_pch(build_rule_t* rule, __job_t* jobs)
+{
+    __job_t* job = &jobs[0];
+    const char* header = rule->target->name;
+
+    if (snprintf(job->depfile, OUT_CAPACITY, "%s.d", rule->output) >= OUT_CAPACITY) UNLIKELY {
+        fprintf(stderr, "nobuild: depfile path too long for '%s'\n", rule->output);
+        return -1;
+    }
+
+    const char* ext  = __source_ext(header);
+    const char* base = strrchr(rule->__flags->argv[0], '/');
+    const int cxx = (ext && (strcmp(ext, ".hpp") == 0 || strcmp(ext, ".hh") == 0 ||
+                             strcmp(ext, ".hxx") == 0 || strcmp(ext, ".H") == 0)) ||
+                    strstr(base ? base + 1 : rule->__flags->argv[0], "++") != NULL;
+
+    //       ("-x" + lang + "-MMD" + "-MF" + depfile + "-o" + pch + header)
+    int tail = 1    + 1    + 1      + 1     + 1       + 1    + 1   + 1;
+    int i = 0;
+    job->argv = __argv_prefix(rule, tail, &i, 0);
+    if (!job->argv) UNLIKELY {
+        return -1;
+    }
+
+    job->argv[i++] = (char*) "-x";
+    job->argv[i++] = (char*) (cxx ? "c++-header" : "c-header");
+    job->argv[i++] = (char*) "-MMD";
+    job->argv[i++] = (char*) "-MF";
+    job->argv[i++] = job->depfile;
+    job->argv[i++] = (char*) "-o";
+    job->argv[i++] = rule->output;
+    job->argv[i++] = (char*) header;
+    job->argv[i]   = NULL;
+    job->argc = i;
+
+    snprintf(job->output, sizeof(job->output), "%s", rule->output);
+
+    job->inputs = __inputs_alloc(1);
+    if (!job->inputs) UNLIKELY {
+        return -1;
+    }
+    job->inputs[job->ninputs++] = (char*) header;
+
+    return __pch_stub(rule);
+}
+
+/*
+ * Unity builds: the unity-safe sources of a split rule (all but the
+ * 'unity_exclude' ones) are grouped by extension into contiguous batches
+ * of balanced size, and each batch is compiled as one generated source,
+ * '<output>.unity/unity_<N><ext>', that #includes its members. A batch file
+ * is only rewritten when its contents change, and the members come back as
+ * implicit inputs from the batch's depfile, so an edit rebuilds just the
+ * batch it belongs to.
+ */
+#define __UNITY_MAX_EXTS 8
+
+static int __unity_excluded(const build_rule_t* rule, const char* src)
+{
+    for (const object_t* o = rule->unity_exclude; o; o = o->__next) {
+        if (o->name == src || strcmp(o->name, src) == 0) { // names are interned
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Assigns every source of 'rule' (target first, then dependencies) to a
+ * batch, storing its index, or -1 if compiled on its own, into 'batch'
+ * when not NULL. Returns the number of batches and stores the number of
+ * sources compiled on their own into '*nalone'.
+ */
+static int __unity_layout(const build_rule_t* rule, int nsrcs, int* batch, int* nalone)
+{
+    *nalone = nsrcs;
+    if (rule->unity == 0 || rule->mode != BUILD_MODE_SPLIT) {
+        if (batch) {
+            for (int n = 0; n < nsrcs; n++) {
+                batch[n] = -1;
+            }
+        }
+        return 0;
+    }
+
+    const char* exts[__UNITY_MAX_EXTS];
+    int counts[__UNITY_MAX_EXTS], seen[__UNITY_MAX_EXTS], base[__UNITY_MAX_EXTS];
+    int nexts = 0, total = 0;
+
+    // First pass: count the members of every extension group.
+    const object_t* src = rule->target;
+    for (int n = 0; n < nsrcs; n++, src = (n == 1) ? rule->dependencies : src->__next) {
+        const char* ext = __source_ext(src->name);
+        if (!ext || __unity_excluded(rule, src->name)) {
+            continue;
+        }
+        int e = 0;
+        while (e < nexts && strcmp(exts[e], ext) != 0) {
+            e++;
+        }
+        if (e == nexts) {
+            if (nexts == __UNITY_MAX_EXTS) {
+                continue;
+            }
+            exts[nexts]   = ext;
+            counts[nexts] = 0;
+            seen[nexts]   = 0;
+            nexts++;
+        }
+        counts[e]++;
+        total++;
+    }
+    *nalone = nsrcs - total;
+
+    // Batches of at most 'size' members, evened out within each group;
+    // UNITY_AUTO spreads the sources over one batch per job slot.
+    const int jobs = __jobs_limit();
+    const int size = (rule->unity > 0) ? rule->unity : (total + jobs - 1) / (jobs > 0 ? jobs : 1);
+
+    int nbatches = 0;
+    for (int e = 0; e < nexts; e++) {
+        base[e]   = nbatches;
+        nbatches += (counts[e] + size - 1) / (size > 0 ? size : 1);
+    }
+    if (!batch) {
+        return nbatches;
+    }
+
+    // Second pass: member 'm' of a group of 'c' split in 'b' batches goes
+    // to batch m * b / c, which keeps batches contiguous and balanced.
+    src = rule->target;
+    for (int n = 0; n < nsrcs; n++, src = (n == 1) ? rule->dependencies : src->__next) {
+        batch[n] = -1;
+        const char* ext = __source_ext(src->name);
+        if (!ext || __unity_excluded(rule, src->name)) {
+            continue;
+        }
+        int e = 0;
+        while (e < nexts && strcmp(exts[e], ext) != 0) {
+            e++;
+        }
+        if (e == nexts) {
+            continue;
+        }
+        const int b = ((e + 1 < nexts) ? base[e + 1] : nbatches) - base[e];
+        batch[n] = base[e] + (int) ((long long) seen[e]++ * b / counts[e]);
+    }
+
+    return nbatches;
+}
+
+/**
+ * Generates batch file 'b' of 'rule', including its 'n' members, and
+ * returns its path (from the run arena), or NULL on failure.
+ */
+static char* __unity_write(build_rule_t* rule, int b, const char* const* members, int n)
+{
+    char dir[OUT_CAPACITY + 8];
+    snprintf(dir, sizeof(dir), "%s.unity", rule->output);
+    mkdir(dir, 0755);
+
+    size_t capacity = 4096, size = 0;
+    char* text = (char*) malloc(capacity);
+    short result = text ? 0 : -1;
+
+    for (int m = 0; m < n && result == 0; m++) {
+        char include[PATH_MAX];
+        if (__include_path(dir, members[m], include, sizeof(include)) != 0) UNLIKELY {
+            fprintf(stderr, "nobuild: cannot include '%s' from '%s'\n", members[m], dir);
+            result = -1;
+            break;
+        }
+
+        const size_t len = strlen(include) + sizeof("#include \"\"\n");
+        if (size + len > capacity) {
+            capacity = 2 * (size + len);
+            char* grown = (char*) realloc(text, capacity);
+            if (!grown) UNLIKELY {
+                perror("realloc");
+                result = -1;
+                break;
+            }
+            text = grown;
+        }
+        size += sprintf(text + size, "#include \"%s\"\n", include);
+    }
+
+    char* path = NULL;
+    if (result == 0) LIKELY {
+        const char* ext = __source_ext(members[0]);
+        const size_t len = strlen(dir) + 32 + strlen(ext);
+        path = (char*) __arena_alloc(&__nob_run, len);
+        if (path) LIKELY {
+            snprintf(path, len, "%s/unity_%d%s", dir, b, ext);
+            if (__write_if_changed(path, text, size) != 0) UNLIKELY {
+                path = NULL;
+            }
+        }
+    } else if (!text) UNLIKELY {
+        perror("malloc");
+    }
+
+    free(text);
+    return path;
+}
+
+/**
+ * Fills a `cc <flags> -MMD -MF <obj>.d -c -o <obj> <src>` job, with room
+ * for 'ninputs' inputs (the first one being 'src'), and makes 'link' wait
+ * for it.
+ */
+static short __plan_compile(build_rule_t* rule, __job_t* job, const char* src, int ninputs, __job_t* link)
+{
+    if (__object_path(src, job->output, OUT_CAPACITY) != 0 ||
+        snprintf(job->depfile, OUT_CAPACITY, "%s.d", job->output) >= OUT_CAPACITY) UNLIKELY {
+        fprintf(stderr, "nobuild: object path too long for '%s'\n", src);
+        return -1;
+    }
+
+    //       (compile options           + "-MMD" + "-MF" + depfile + "-c" + "-o" + obj + src)
+    int tail = __compile_noptions(rule) + 1      + 1     + 1       + 1    + 1    + 1   + 1;
+    int i = 0;
+    job->argv = __argv_prefix(rule, tail, &i, 1);
+    if (!job->argv) UNLIKELY {
+        return -1;
+    }
+
+    i = __compile_options(rule, job->argv, i);
+    job->__offload = (rule->pch == NULL);
+    job->argv[i++] = (char*) "-MMD";
+    job->argv[i++] = (char*) "-MF";
+    job->argv[i++] = job->depfile;
+    job->argv[i++] = (char*) "-c";
+    job->argv[i++] = (char*) "-o";
+    job->argv[i++] = job->output;
+    job->argv[i++] = (char*) src;
+    job->argv[i]   = NULL;
+    job->argc = i;
+
+    job->inputs = __inputs_alloc(ninputs + (rule->pch != NULL));
+    if (!job->inputs) UNLIKELY {
+        return -1;
+    }
+    job->inputs[job->ninputs++] = (char*) src;
+
+    link->argv[link->argc++] = job->output;
+    link->inputs[link->ninputs++] = job->output;
+    return __job_then(job, link);
+}
+
+/**
+ * BUILD_MODE_SPLIT: one `cc <flags> -MMD -MF <obj>.d -c -o <obj> <src>` job
+ * per source (or per unity batch, which come first) and a final
+ * `cc <flags> -o <output> <objs>` job depending on all of them, or
+ * `ar rcsD <output> <objs>` for a static library. Room is left for 'extra'
+ * more link inputs.
+ */
+static short __plan_split(build_rule_t* rule, __job_t* jobs, int nsrcs, int extra)
+{
+    int* batch = (int*) __arena_alloc(&__nob_run, nsrcs * sizeof(int));
+    if (!batch) UNLIKELY {
+        return -1;
+    }
+    int nalone = 0;
+    const int nbatches = __unity_layout(rule, nsrcs, batch, &nalone);
+
+    // Counting sort of the batched sources: batch 'b' gets members
+    // [start[b], start[b + 1]).
+    int* start = (int*) __arena_alloc(&__nob_run, (nbatches + 2) * sizeof(int));
+    const char** members = (const char**) __arena_alloc(&__nob_run, nsrcs * sizeof(char*));
+    if (!start || !members) UNLIKELY {
+        return -1;
+    }
+    memset(start, 0, (nbatches + 2) * sizeof(int));
+
+    for (int n = 0; n < nsrcs; n++) {
+        if (batch[n] >= 0) {
+            start[batch[n] + 2]++;
+        }
+    }
+    for (int b = 0; b < nbatches; b++) {
+        start[b + 2] += start[b + 1];
+    }
+
+    const object_t* src = rule->target;
+    for (int n = 0; n < nsrcs; n++, src = (n == 1) ? rule->dependencies : src->__next) {
+        if (batch[n] >= 0) {
+            members[start[batch[n] + 1]++] = src->name;
+        }
+    }
+
+    const int ncompiles = nbatches + nalone;
+    __job_t* link = &jobs[ncompiles];
+
+    if (rule->kind == RULE_STATIC_LIB) {
+        link->argv = (char**) __arena_alloc(&__nob_run, (3 + ncompiles + 1) * sizeof(char*));
+        if (!link->argv) UNLIKELY {
+            return -1;
+        }
+        // Deterministic: zero timestamps, uids and modes.
+        link->argv[link->argc++] = (char*) NOB_AR;
+        link->argv[link->argc++] = (char*) "rcsD";
+        link->argv[link->argc++] = rule->output;
+        link->__clean = 1;
+    } else {
+        link->argv = __argv_prefix(rule, __link_noptions(rule) + 1 + 1 + ncompiles + extra, &link->argc, 0);
+        if (!link->argv || (link->argc = __link_options(rule, link->argv, link->argc)) < 0 ||
+            __link_toc(rule, link) != 0) UNLIKELY {
+            return -1;
+        }
+        link->argv[link->argc++] = (char*) "-o";
+        link->argv[link->argc++] = rule->output;
+        link->__slots = __link_slots(rule);
+    }
+    snprintf(link->output, sizeof(link->output), "%s", rule->output);
+
+    link->inputs = __inputs_alloc(ncompiles + extra);
+    if (!link->inputs) UNLIKELY {
+        return -1;
+    }
+
+    for (int b = 0; b < nbatches; b++) {
+        const int n = start[b + 1] - start[b];
+        char* path = __unity_write(rule, b, members + start[b], n);
+        if (!path || __plan_compile(rule, &jobs[b], path, 1 + n, link) != 0) UNLIKELY {
+            return -1;
+        }
+        for (int m = start[b]; m < start[b + 1]; m++) {
+            jobs[b].inputs[jobs[b].ninputs++] = (char*) members[m];
+        }
+    }
+
+    src = rule->target;
+    for (int n = 0, j = nbatches; n < nsrcs; n++, src = (n == 1) ? rule->dependencies : src->__next) {
+        if (batch[n] < 0 && __plan_compile(rule, &jobs[j++], src->name, 1, link) != 0) UNLIKELY {
+            return -1;
+        }
+    }
+    link->argv[link->argc] = NULL;
 
-    for (object_t* o = rule->dependencies; o; o = o->__next) LIKELY {
-        argc++;
+    return 0;
+}
+
+static short __rule_valid(const build_rule_t* rule)
+{
+    return rule && rule->cc && rule->__flags && rule->target &&
+           (rule->dependencies || rule->mode == BUILD_MODE_PCH) &&
+           (!rule->pch || rule->pch->mode == BUILD_MODE_PCH);
+}
+
+/**
+ * Archives always get their objects from split compiles.
+ */
+static inline int __rule_split(const build_rule_t* rule)
+{
+    return rule->mode == BUILD_MODE_SPLIT || (rule->mode == BUILD_MODE_SINGLE && rule->kind == RULE_STATIC_LIB);
+}
+
+static int __rule_njobs(const build_rule_t* rule)
+{
+    const int nsrcs = 1 + __object_t_count(rule->dependencies); // target + deps
+    if (!__rule_split(rule)) {
+        return 1;
     }
 
-    //   += (compiler + "-o" + output + target + NULL)
-    argc += (1        + 1    + 1      + 1      + 1); 
+    // Sources compiled on their own, unity batches and the link.
+    int nalone = 0;
+    const int nbatches = __unity_layout(rule, nsrcs, NULL, &nalone);
+    return nalone + nbatches + 1;
+}
 
-    // Allocate argv array
-    char** argv = (char**) calloc(argc, sizeof(char*));
-    if (!argv) UNLIKELY {
+/**
+ * Number of outputs of other rules a link of 'rule' consumes: those of the
+ * rules it depends on and, through static libraries, of the rules these
+ * depend on. (Archives themselves consume none.)
+ */
+static int __rule_nlinked(const build_rule_t* rule)
+{
+    int n = 0;
+    for (const rule_dep_t* d = rule->upstream; d; d = d->__next) {
+        n += 1 + ((d->rule->kind == RULE_STATIC_LIB) ? __rule_nlinked(d->rule) : 0);
+    }
+    return n;
+}
+
+/**
+ * Feeds the outputs counted by __rule_nlinked() to 'final', a static
+ * library coming before the libraries it needs. Shared libraries are
+ * tracked through their interface file.
+ */
+static short __rule_link(__job_t* jobs, const build_rule_t* rule, __job_t* final)
+{
+    for (const rule_dep_t* d = rule->upstream; d; d = d->__next) {
+        __job_t* upstream = &jobs[d->rule->__final];
+
+        final->argv[final->argc++] = upstream->output;
+        final->argv[final->argc]   = NULL;
+        final->inputs[final->ninputs++] = upstream->__toc ? upstream->__toc : upstream->output;
+        if (__job_then(upstream, final) != 0) UNLIKELY {
+            return -1;
+        }
+
+        if (d->rule->kind == RULE_STATIC_LIB && __rule_link(jobs, d->rule, final) != 0) UNLIKELY {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Appends every rule reachable from 'rule' to 'order' (dependencies first).
+ * '__visit' is 1 while a rule is on the DFS stack and 2 once it has been
+ * emitted, so meeting a rule in state 1 means the graph has a cycle.
+ */
+static short __graph_sort(build_rule_t* rule, build_rule_t*** order, int* n, int* capacity)
+{
+    if (rule->__visit == 2) {
+        return 0;
+    }
+    if (rule->__visit == 1) UNLIKELY {
+        fprintf(stderr, "nobuild: dependency cycle through '%s'\n", rule->output);
+        return -1;
+    }
+    if (!__rule_valid(rule)) UNLIKELY {
+        fprintf(stderr, "nobuild: incomplete rule '%s'\n", rule->output);
+        return -1;
+    }
+
+    rule->__visit = 1;
+    if (rule->pch && __graph_sort(rule->pch, order, n, capacity) != 0) {
+        return -1;
+    }
+    for (rule_dep_t* d = rule->upstream; d; d = d->__next) {
+        if (__graph_sort(d->rule, order, n, capacity) != 0) {
+            return -1;
+        }
+    }
+    rule->__visit = 2;
+
+    if (*n == *capacity) {
+        int grown = (*capacity) ? 2 * (*capacity) : 16;
+        build_rule_t** resized = (build_rule_t**) realloc(*order, grown * sizeof(build_rule_t*));
+        if (!resized) UNLIKELY {
+            perror("realloc");
+            return -1;
+        }
+        *order = resized;
+        *capacity = grown;
+    }
+    (*order)[(*n)++] = rule;
+
+    return 0;
+}
+
+static void __graph_reset(build_rule_t* rule)
+{
+    if (!rule || rule->__visit == 0) {
+        return;
+    }
+
+    rule->__visit = 0;
+    __graph_reset(rule->pch);
+    for (rule_dep_t* d = rule->upstream; d; d = d->__next) {
+        __graph_reset(d->rule);
+    }
+}
+
+/**
+ * Turns rules sorted by __graph_sort() into their jobs, wired together
+ * and with their command hashes computed. Command lines, input lists and
+ * successor lists are carved out of the run arena in a single pass over
+ * each rule's lists, sized by the counts the lists keep. On success the
+ * jobs are stored into '*out' and '*count'; they are released with
+ * __jobs_free().
+ */
+static short __plan_graph(build_rule_t** order, int nrules, __job_t** out, int* count)
+{
+    short result = 0;
+
+    int njobs = 0;
+    for (int r = 0; r < nrules && result == 0; r++) {
+        order[r]->__final = njobs + __rule_njobs(order[r]) - 1;
+        njobs = order[r]->__final + 1;
+    }
+
+    __job_t* jobs = (result == 0) ? (__job_t*) calloc(njobs, sizeof(__job_t)) : NULL;
+    if (result == 0 && !jobs) UNLIKELY {
         perror("calloc");
+        result = -1;
+    }
+    for (int j = 0; jobs && j < njobs; j++) {
+        jobs[j].__out_fd = -1;
+        jobs[j].__pidfd  = -1;
+        jobs[j].__slots  = 1;
+    }
+
+    for (int r = 0, first = 0; r < nrules && result == 0; r++) {
+        build_rule_t* rule = order[r];
+
+        const int nsrcs = 1 + __object_t_count(rule->dependencies); // target + deps
+
+        const int extra = (rule->kind == RULE_STATIC_LIB) ? 0 : __rule_nlinked(rule);
+        if (rule->mode == BUILD_MODE_PCH) {
+            result = __plan_pch(rule, &jobs[first]);
+        } else if (__rule_split(rule)) {
+            result = __plan_split(rule, &jobs[first], nsrcs, extra);
+        } else {
+            result = __plan_single(rule, &jobs[first], nsrcs, extra);
+        }
+
+        // Compiles (every job but the link in split mode) wait for the PCH
+        // and are rebuilt when it changes.
+        if (rule->pch && result == 0) {
+            __job_t* pch = &jobs[rule->pch->__final];
+            const int last = __rule_split(rule) ? rule->__final - 1 : rule->__final;
+            for (int j = first; j <= last && result == 0; j++) {
+                jobs[j].inputs[jobs[j].ninputs++] = pch->output;
+                result = __job_then(pch, &jobs[j]);
+            }
+        }
+
+        const __flag_set_t* set = rule->__flags;
+        for (int j = first; j <= rule->__final && result == 0; j++) LIKELY {
+            jobs[j].__prefix = set;
+        }
+        if (rule->kind == RULE_STATIC_LIB && result == 0) {
+            jobs[rule->__final].__prefix = NULL; // The archiver's argv is all its own.
+        }
+
+        if (rule->kind != RULE_STATIC_LIB && result == 0) {
+            result = __rule_link(jobs, rule, &jobs[rule->__final]);
+        }
+        if (rule->kind != RULE_STATIC_LIB && rule->mode != BUILD_MODE_PCH && result == 0) {
+            result = __link_jobs(rule, &jobs[rule->__final]);
+        }
+
+        first = rule->__final + 1;
+    }
+
+    // Same values as __hash_argv(argv), the prefix being hashed once, and
+    // the options sized to the job slots not at all.
+    for (int j = 0; j < njobs && result == 0; j++) LIKELY {
+        __job_t* job = &jobs[j];
+        const __flag_set_t* set = job->__prefix;
+        char* sized = job->__sized ? job->argv[job->argc - job->__sized] : NULL;
+        if (sized) {
+            job->argv[job->argc - job->__sized] = NULL;
+        }
+        job->cmd_hash = set ? __hash_argv_from(set->hash, job->argv + set->argc) : __hash_argv(job->argv);
+        if (sized) {
+            job->argv[job->argc - job->__sized] = sized;
+        }
+    }
+
+    if (result != 0 && jobs) UNLIKELY {
+        __jobs_free(jobs, njobs);
+        jobs = NULL;
+    }
+
+    *out   = jobs;
+    *count = (result == 0) ? njobs : 0;
+    return result;
+}
+
+/**
+ * Plans the jobs of every rule reachable from 'roots' into one DAG and runs
+ * it. A rule's final job (link, or the single compile) consumes the outputs
+ * of the rules it requires and waits for their final jobs only, so its own
+ * compiles overlap with the upstream rules. With 'watch' it then keeps
+ * rebuilding on changes (see __watch()).
+ */
+static short __build_graph(build_rule_t** roots, int nroots, int watch)
+{
+    build_rule_t** order = NULL;
+    int nrules = 0, capacity = 0;
+    short result = 0;
+
+    for (int r = 0; r < nroots && result == 0; r++) {
+        result = __graph_sort(roots[r], &order, &nrules, &capacity);
+    }
+
+    __job_t* jobs = NULL;
+    int njobs = 0;
+    if (result == 0) LIKELY {
+        __cache_open(); // ThinLTO links keep their cache in it.
+        result = __plan_graph(order, nrules, &jobs, &njobs);
+    }
+
+    if (result == 0) LIKELY {
+        const char* check = getenv("NOB_CHECK");
+        if (!__nob_check_set && check && strcmp(check, "hash") == 0) {
+            __nob_check = CHECK_HASH;
+        }
+
+        __db_open();
+        __compdb_write(jobs, njobs);
+        result = __build_jobs(jobs, njobs);
+        if (watch) {
+            result = __watch(jobs, njobs);
+        }
+    }
+
+    for (int r = 0; r < nroots; r++) {
+        __graph_reset(roots[r]);
+    }
+
+    if (jobs) {
+        __jobs_free(jobs, njobs);
+    }
+    free(order);
+    return result;
+}
+
+short __build(build_rule_t* rule)
+{
+    if (!rule || !rule->cc || !rule->target || (!rule->dependencies && rule->mode != BUILD_MODE_PCH)) UNLIKELY {
         return -1;
     }
 
-    int i = 0;
-    argv[i++] = rule->cc->cmd; // compiler, e.g., "gcc"
+    return __build_graph(&rule, 1, 0);
+}
 
-    // Add all flags
-    for (flag_t* f = rule->cc->flags; f; f = f->__next) LIKELY {
-        argv[i++] = f->name;
+/**
+ * Checks the roots given to BUILD_ALL() and WATCH().
+ */
+static int __roots_valid(build_rule_t** rules, int nrules)
+{
+    if (!rules || nrules <= 0) {
+        return 0;
+    }
+    for (int r = 0; r < nrules; r++) {
+        if (!rules[r]) UNLIKELY {
+            fprintf(stderr, "nobuild: rule %d of %d is NULL\n", r, nrules);
+            return 0;
+        }
     }
+    return 1;
+}
 
-    // Output option
-    argv[i++] = "-o";
-    argv[i++] = rule->output;
+short BUILD_ALL(build_rule_t** rules, int nrules)
+{
+    if (!__roots_valid(rules, nrules)) {
+        return -1;
+    }
 
-    argv[i++] = rule->target->name;
+    return __build_graph(rules, nrules, 0);
+}
 
-    // Dependencies
-    for (object_t* o = rule->dependencies; o; o = o->__next) LIKELY {
-        argv[i++] = o->name;
+short WATCH(build_rule_t** rules, int nrules)
+{
+    if (!__roots_valid(rules, nrules)) {
+        return -1;
     }
 
-    argv[i] = NULL; // execvp() needs NULL-terminated array
+    return __build_graph(rules, nrules, 1);
+}
 
-    // Fork process
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        free(argv);
+
+
+/************************************************************
+ * Globbing
+ ************************************************************/
+
+/*
+ * GLOB_OBJECTS() splits the pattern into '/'-separated components and
+ * walks the tree below its literal prefix. A work item is a directory
+ * together with the index of the component its entries are matched
+ * against; a "**" component both recurses into every subdirectory and
+ * lets the following component match right there, so each directory is
+ * read once. Like bash's globstar, "**" never enters a symbolic link to a
+ * directory (a named component may), so link loops cannot make the walk
+ * endless. Entries are read with readdir(), whose d_type saves a stat()
+ * on the file systems that fill it in. Items live on a shared stack that
+ * a few threads pop from until it is empty and none of them is still
+ * reading a directory (the threads that run out of local work "steal"
+ * whatever the others pushed). Matches are sorted, so the result does not
+ * depend on scheduling or directory order. NOB_NO_THREADS makes the walk
+ * run on the calling thread, for C libraries that need -pthread.
+ */
+#define __GLOB_THREADS 8
+#define __GLOB_MAX     64   /* Pattern components. */
+
+typedef struct __glob_item {
+    char* dir;
+    int comp;
+} __glob_item_t;
+
+typedef struct __glob {
+    char* comps[__GLOB_MAX];
+    int ncomps;
+
+    __glob_item_t* items;       /* Stack of directories left to read. */
+    int nitems, capitems;
+    int busy;                   /* Threads reading a directory. */
+
+    char** matches;
+    int nmatches, capmatches;
+    int failed;
+
+#ifndef NOB_NO_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+} __glob_t;
+
+static inline void __glob_lock(__glob_t* g)
+{
+#ifndef NOB_NO_THREADS
+    pthread_mutex_lock(&g->lock);
+#else
+    (void) g;
+#endif
+}
+
+static inline void __glob_unlock(__glob_t* g)
+{
+#ifndef NOB_NO_THREADS
+    pthread_mutex_unlock(&g->lock);
+#else
+    (void) g;
+#endif
+}
+
+/**
+ * Queues 'dir' (taking ownership) to be matched against component 'comp'.
+ * Called with the lock held.
+ */
+static void __glob_push(__glob_t* g, char* dir, int comp)
+{
+    if (g->nitems == g->capitems) {
+        const int capacity = g->capitems ? 2 * g->capitems : 64;
+        __glob_item_t* items = (__glob_item_t*) realloc(g->items, capacity * sizeof(__glob_item_t));
+        if (!items) UNLIKELY {
+            perror("realloc");
+            free(dir);
+            g->failed = 1;
+            return;
+        }
+        g->items    = items;
+        g->capitems = capacity;
+    }
+
+    g->items[g->nitems].dir  = dir;
+    g->items[g->nitems].comp = comp;
+    g->nitems++;
+#ifndef NOB_NO_THREADS
+    pthread_cond_signal(&g->wake);
+#endif
+}
+
+/**
+ * Records 'path' (taking ownership) as a match. Called with the lock held.
+ */
+static void __glob_match(__glob_t* g, char* path)
+{
+    if (g->nmatches == g->capmatches) {
+        const int capacity = g->capmatches ? 2 * g->capmatches : 256;
+        char** matches = (char**) realloc(g->matches, capacity * sizeof(char*));
+        if (!matches) UNLIKELY {
+            perror("realloc");
+            free(path);
+            g->failed = 1;
+            return;
+        }
+        g->matches    = matches;
+        g->capmatches = capacity;
+    }
+    g->matches[g->nmatches++] = path;
+}
+
+/**
+ * Returns 'dir'/'name', without the "./" a relative walk starts from.
+ */
+static char* __glob_join(const char* dir, const char* name)
+{
+    if (strcmp(dir, ".") == 0) {
+        return strdup(name);
+    }
+
+    size_t ldir = strlen(dir);
+    const size_t lname = strlen(name);
+    ldir -= (dir[ldir - 1] == '/');
+
+    char* path = (char*) malloc(ldir + lname + 2);
+    if (path) LIKELY {
+        memcpy(path, dir, ldir);
+        path[ldir] = '/';
+        memcpy(path + ldir + 1, name, lname + 1);
+    }
+    return path;
+}
+
+/**
+ * Reads one directory, matching its entries against component 'comp'
+ * (and the one after it, when 'comp' is "**").
+ */
+static void __glob_read(__glob_t* g, const char* dir, int comp)
+{
+    DIR* d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    const int last = g->ncomps - 1;
+    const int deep = (strcmp(g->comps[comp], "**") == 0);
+    const int next = deep ? comp + 1 : comp;   // Component a name is matched against.
+
+    for (struct dirent* e; (e = readdir(d)) != NULL;) {
+        const char* name = e->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        int isdir = -1, islink = -1;
+#ifdef DT_DIR
+        if (e->d_type != DT_UNKNOWN) {
+            islink = (e->d_type == DT_LNK);
+            isdir  = islink ? -1 : (e->d_type == DT_DIR);
+        }
+#endif
+        const int matched = (next <= last) ? (fnmatch(g->comps[next], name, FNM_PERIOD) == 0) : 0;
+        const int hidden  = (name[0] == '.');
+        if (!matched && !(deep && !hidden)) {
+            continue;
+        }
+
+        char* path = __glob_join(dir, name);
+        if (!path) UNLIKELY {
+            g->failed = 1;
+            break;
+        }
+        struct stat st;
+        if (islink < 0 && lstat(path, &st) == 0) {
+            islink = S_ISLNK(st.st_mode);
+            isdir  = islink ? -1 : S_ISDIR(st.st_mode);
+        }
+        if (isdir < 0) {
+            isdir = (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+        }
+
+        __glob_lock(g);
+        if (isdir && deep && !hidden && islink <= 0) {
+            char* copy = strdup(path);
+            if (copy) LIKELY {
+                __glob_push(g, copy, comp);
+            }
+        }
+        if (matched && isdir && next < last) {
+            __glob_push(g, path, next + 1);
+        } else if (matched && !isdir && next == last) {
+            __glob_match(g, path);
+        } else {
+            free(path);
+        }
+        __glob_unlock(g);
+    }
+
+    closedir(d);
+}
+
+static void* __glob_worker(void* arg)
+{
+    __glob_t* g = (__glob_t*) arg;
+
+    __glob_lock(g);
+    for (;;) {
+        while (g->nitems == 0 && g->busy > 0) {
+#ifndef NOB_NO_THREADS
+            pthread_cond_wait(&g->wake, &g->lock);
+#endif
+        }
+        if (g->nitems == 0) {
+            break;
+        }
+
+        __glob_item_t item = g->items[--g->nitems];
+        g->busy++;
+        __glob_unlock(g);
+
+        __glob_read(g, item.dir, item.comp);
+        free(item.dir);
+
+        __glob_lock(g);
+        g->busy--;
+    }
+#ifndef NOB_NO_THREADS
+    pthread_cond_broadcast(&g->wake);
+#endif
+    __glob_unlock(g);
+    return NULL;
+}
+
+static int __glob_cmp(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+int GLOB_OBJECTS(object_t** objects, const char* pattern)
+{
+    if (!objects || !pattern || !pattern[0]) UNLIKELY {
         return -1;
     }
 
-    if (pid == 0) {
-        // Child process
-        execvp(argv[0], argv);
-        perror("execvp"); // Only if execvp fails
-        exit(EXIT_FAILURE);
+    if (!strpbrk(pattern, "*?[")) {
+        struct stat st;
+        if (stat(pattern, &st) != 0 || S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        ADD_OBJECT(objects, OBJECT(pattern));
+        return 1;
     }
 
-    // Parent process
-    int status = 0;
-    waitpid(pid, &status, 0);
+    __glob_t* g = (__glob_t*) calloc(1, sizeof(__glob_t));
+    char* copy = strdup(pattern);
+    if (!g || !copy) UNLIKELY {
+        perror("calloc");
+        free(g);
+        free(copy);
+        return -1;
+    }
 
-    free(argv);
+    // The components before the first wildcard make up the root of the walk.
+    char* wild = copy + strcspn(copy, "*?[");
+    while (wild > copy && wild[-1] != '/') {
+        wild--;
+    }
+    char* root = copy;
+    if (wild == copy) {
+        root = (char*) ".";
+    } else if (wild == copy + 1) {
+        root = (char*) "/";
+    } else {
+        wild[-1] = '\0';
+    }
+
+    for (char* c = wild; *c;) {
+        char* end = c + strcspn(c, "/");
+        const int more = (*end == '/');
+        *end = '\0';
+        const int skip = (!*c || (strcmp(c, "**") == 0 && g->ncomps > 0 && strcmp(g->comps[g->ncomps - 1], "**") == 0));
+        if (!skip && g->ncomps < __GLOB_MAX - 1) {
+            g->comps[g->ncomps++] = c;
+        }
+        c = more ? end + 1 : end;
+    }
+    if (g->ncomps == 0 || strcmp(g->comps[g->ncomps - 1], "**") == 0) {
+        g->comps[g->ncomps++] = (char*) "*";   // "dir/**" lists every file below 'dir'.
+    }
+
+    char* start = strdup(root);
+    if (start) LIKELY {
+        __glob_push(g, start, 0);
+    }
+
+#ifndef NOB_NO_THREADS
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->wake, NULL);
+
+    pthread_t threads[__GLOB_THREADS];
+    int nthreads = 0;
+    const int limit = __jobs_limit() - 1;
+    while (nthreads < limit && nthreads < __GLOB_THREADS &&
+           pthread_create(&threads[nthreads], NULL, __glob_worker, g) == 0) {
+        nthreads++;
+    }
+#endif
+
+    __glob_worker(g);
+
+#ifndef NOB_NO_THREADS
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_cond_destroy(&g->wake);
+    pthread_mutex_destroy(&g->lock);
+#endif
+
+    // A "**" may reach a file along two paths, e.g. "**/a/**/*.c".
+    qsort(g->matches, g->nmatches, sizeof(char*), __glob_cmp);
+    int added = 0;
+    for (int m = 0; !g->failed && m < g->nmatches; m++) {
+        if (m == 0 || strcmp(g->matches[m], g->matches[m - 1]) != 0) {
+            ADD_OBJECT(objects, OBJECT(g->matches[m]));
+            added++;
+        }
+    }
+
+    for (int m = 0; m < g->nmatches; m++) {
+        free(g->matches[m]);
+    }
+    free(g->matches);
+    free(g->items);
+    const int failed = g->failed;
+    free(g);
+    free(copy);
+    return failed ? -1 : added;
+}
+
+
+
+/************************************************************
+ * Self Rebuild
+ ************************************************************/
+
+/*
+ * The up-to-date check stat()s the binary (argv[0] when it holds a path,
+ * /proc/self/exe otherwise), the build program's source and this header,
+ * as __FILE__ named them when the program was compiled: relative to the
+ * directory the compiler ran in, which is the binary's own in the usual
+ * `cc -o nob nob.c`, whatever directory it is later run from. The new
+ * binary is renamed over the old one only once it compiled, and
+ * NOB_REBUILT, set across the exec, keeps a clock skew from causing a
+ * rebuild loop.
+ */
+static const char __nob_header[] = __FILE__;
+
+void __rebuild_self(int argc, char** argv, const char* source)
+{
+    (void) argc;
+
+    if (getenv("NOB_REBUILT")) {
+        unsetenv("NOB_REBUILT");
+        return;
+    }
 
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        return 0; // success
+    char found[PATH_MAX], binary[PATH_MAX];
+    if (argv[0] && strchr(argv[0], '/')) {
+        snprintf(found, sizeof(found), "%s", argv[0]);
     } else {
-        return -1; // failure
+        const ssize_t n = readlink("/proc/self/exe", found, sizeof(found) - 1);
+        if (n <= 0) {
+            return;
+        }
+        found[n] = '\0';
+    }
+
+    struct stat st;
+    if (!realpath(found, binary) || stat(binary, &st) != 0) {
+        return;
+    }
+    const long long built = __MTIME_NS(st);
+
+    // The directory __FILE__ paths are relative to.
+    char dir[PATH_MAX], path[2 * PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int) (strrchr(binary, '/') - binary), binary);
+    snprintf(path, sizeof(path), "%s/%s", dir, source);
+    if (source[0] != '/' && stat(path, &st) != 0) {
+        snprintf(dir, sizeof(dir), ".");
+    }
+
+    int stale = 0;
+    const char* inputs[] = { source, __nob_header };
+    for (int k = 0; k < 2 && !stale; k++) {
+        snprintf(path, sizeof(path), "%s/%s", (inputs[k][0] == '/') ? "" : dir, inputs[k]);
+        stale = (stat(path, &st) == 0 && __MTIME_NS(st) > built);
+    }
+    if (!stale) LIKELY {
+        return;
+    }
+
+    char temp[PATH_MAX + 8];
+    snprintf(temp, sizeof(temp), "%s.new", binary);
+
+    // Wherever the header was found, it will be found again.
+    char include[PATH_MAX + 2] = "-I.";
+    const char* slash = strrchr(__nob_header, '/');
+    if (slash) {
+        snprintf(include, sizeof(include), "-I%.*s", (int) (slash - __nob_header), __nob_header);
+    }
+
+    // Flags go after the source, where libraries have to be.
+    char flags[] = NOB_REBUILD_FLAGS;
+    char* cc[64] = { (char*) NOB_REBUILD_CC, include, (char*) "-o", temp, (char*) source };
+    int n = 5;
+    for (char* f = strtok(flags, " \t"); f && n < 63; f = strtok(NULL, " \t")) {
+        cc[n++] = f;
+    }
+    cc[n] = NULL;
+
+    printf("nobuild: '%s' changed, rebuilding '%s'\n", source, binary);
+    fflush(stdout);
+
+    int status = 0;
+    const int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    pid_t pid = (cwd >= 0 && chdir(dir) == 0) ? __spawn(cc, -1) : -1;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (cwd >= 0 && fchdir(cwd) != 0) UNLIKELY {
+        perror("fchdir");
+        exit(EXIT_FAILURE);
+    }
+    if (cwd >= 0) {
+        close(cwd);
     }
+
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || rename(temp, binary) != 0) {
+        unlink(temp);
+        fprintf(stderr, "nobuild: could not rebuild '%s'\n", binary);
+        exit(EXIT_FAILURE);
+    }
+
+    setenv("NOB_REBUILT", "1", 1);
+    execv(binary, argv);
+    perror("execv");
+    exit(EXIT_FAILURE);
 }
 #endif  // NOB_IMPL
 
@@ -0,0 +1,54 @@
+/*
+ * Checks that GLOB_OBJECTS() finds every file once and terminates when the
+ * tree holds symbolic link loops, which "**" must not follow.
+ *
+ *   cc -I.. -o glob glob.c && ./glob
+ */
+#define NOB_IMPL 0
+#include "nobuild.h"
+#include <assert.h>
+
+static void touch(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    assert(f != NULL);
+    fclose(f);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/nobuild-glob-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    assert(chdir(dir) == 0);
+
+    assert(mkdir("src", 0755) == 0);
+    assert(mkdir("src/a", 0755) == 0);
+    assert(mkdir("src/b", 0755) == 0);
+    touch("src/main.c");
+    touch("src/a/foo.c");
+    touch("src/b/bar.c");
+
+    // One loop back to the root of the walk, and two that multiply.
+    assert(symlink("..", "src/a/loop") == 0);
+    assert(symlink("../a", "src/b/to_a") == 0);
+    assert(symlink("../b", "src/a/to_b") == 0);
+
+    object_t* objects = NULL;
+    const int n = GLOB_OBJECTS(&objects, "src/**/*.c");
+    assert(n == 3);
+    assert(strcmp(objects->name, "src/a/foo.c") == 0);
+    assert(strcmp(objects->__next->name, "src/b/bar.c") == 0);
+    assert(strcmp(objects->__next->__next->name, "src/main.c") == 0);
+
+    // A link named by the pattern itself is still entered.
+    object_t* linked = NULL;
+    assert(GLOB_OBJECTS(&linked, "src/a/to_b/*.c") == 1);
+    assert(strcmp(linked->name, "src/a/to_b/bar.c") == 0);
+
+    char* rm[] = { (char*) "rm", (char*) "-rf", dir, NULL };
+    pid_t pid = __spawn(rm, -1);
+    assert(pid > 0 && waitpid(pid, NULL, 0) == pid);
+
+    printf("glob: ok\n");
+    return 0;
+}